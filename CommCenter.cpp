@@ -37,275 +37,2210 @@
  */
 
 #include "CommCenter.hpp"
+#include "CommCenterPrivate.hpp"
 
-#define SHM_RAILS_KEY    "rails"
-#define SHM_RAILS_SIZE   32768     /* bytes */
+#include <QMutex>
+#include <QThread>
 
-struct CommCenterPrivate 
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#define DOORBELL_PREFIX  "rails-doorbell-"
+
+#define PEER_LEASE_REFRESH  1000    /* Milliseconds between lease renewals
+                                     * and checks for dead peers.
+                                     */
+#define PEER_LEASE_EXPR     30000   /* A peer that has not renewed its lease
+                                     * for this long is evicted if its 
+                                     * process has gone away ...
+                                     */
+#define PEER_LEASE_LIMIT    600000  /* ... and regardless once it is this 
+                                     * old, in case the process ID has 
+                                     * been reused.
+                                     */
+#define ROSTER_READ_SPINS   1000    /* Yields a reader waits for a change 
+                                     * to the peer table to finish before 
+                                     * taking the lock instead.
+                                     */
+
+#define MSG_BUSY_SPINS   1000      /* Times postMessage() will yield waiting 
+                                    * for another producer to publish.
+                                    */
+#define MSG_WAIT_USECS   1000      /* Time sendWait() sleeps between looks
+                                    * for room in the ring or the arena.
+                                    */
+
+/* ---------- Atomic Helpers ---------- */
+
+/* The GCC __sync builtins are full memory barriers.  On x86-64 an aligned 
+ * load is atomic and already has acquire semantics, elsewhere a plain load 
+ * is not enough for a qint64 so loads go through the builtins as well.
+ */
+static inline qint64 atomic_load(qint64 *p)
 {
-    qint64 next_id;
-    qint64 nobservers;
-    struct Message msgs[MSG_MAX_COUNT];
-};
+#if defined(__x86_64__)
+    qint64 val = *(volatile qint64 *)p;
+    __asm__ __volatile__("" ::: "memory");
+    return val;
+#else
+    return __sync_fetch_and_add((volatile qint64 *)p, 0);
+#endif
+}
 
-CommCenter::CommCenter(QObject * parent)
-    : QObject(parent), sharedMemory(SHM_RAILS_KEY)
+static inline void atomic_store(qint64 *p, qint64 val)
 {
-    if(sharedMemory.attach())
-        return;
+#if defined(__x86_64__)
+    __asm__ __volatile__("" ::: "memory");
+    *(volatile qint64 *)p = val;
+#else
+    qint64 old_val;
 
-    if(sharedMemory.error() != QSharedMemory::NotFound)
+    do
     {
-        qDebug() << "Error: sharedMemory.attach() :: " << \
-            sharedMemory.errorString();
+        old_val = *(volatile qint64 *)p;
+    } while(!__sync_bool_compare_and_swap((volatile qint64 *)p, 
+                                          old_val, val));
+#endif
+}
+
+static inline bool atomic_cas(qint64 *p, qint64 old_val, qint64 new_val)
+{
+    return __sync_bool_compare_and_swap((volatile qint64 *)p, 
+                                        old_val, new_val);
+}
+
+/* atomic_set_bits() and atomic_clear_bits() return the previous value. */
+static inline qint64 atomic_set_bits(qint64 *p, qint64 bits)
+{
+    return __sync_fetch_and_or((volatile qint64 *)p, bits);
+}
+
+static inline qint64 atomic_clear_bits(qint64 *p, qint64 bits)
+{
+    return __sync_fetch_and_and((volatile qint64 *)p, ~bits);
+}
+
+static inline qint64 atomic_inc(qint64 *p)
+{
+    return __sync_add_and_fetch((volatile qint64 *)p, 1);
+}
+
+static inline qint64 atomic_dec(qint64 *p)
+{
+    return __sync_sub_and_fetch((volatile qint64 *)p, 1);
+}
+
+static inline void atomic_add(qint64 *p, qint64 val)
+{
+    __sync_fetch_and_add((volatile qint64 *)p, val);
+}
+
+/* Raise *p to val, or lower it, if val is larger, or smaller. */
+static inline void atomic_max(qint64 *p, qint64 val)
+{
+    qint64 old_val;
+
+    while((old_val = atomic_load(p)) < val && !atomic_cas(p, old_val, val))
+        ;
+}
+
+static inline void atomic_min(qint64 *p, qint64 val)
+{
+    qint64 old_val;
+
+    while((old_val = atomic_load(p)) > val && !atomic_cas(p, old_val, val))
+        ;
+}
+
+static bool process_alive(qint64 pid)
+{
+    return kill((pid_t)pid, 0) == 0 || errno != ESRCH;
+}
+
+/* ---------- Statistics ---------- */
+
+/* Operation a message is counted under, see struct CommStats. */
+static int message_op(const char *data, qint64 size)
+{
+    return size > 0 ? (unsigned char)data[0] : 0;
+}
+
+/* Add n to one of the counters of lane and of operation op. */
+static void stat_add(CommCenterPrivate *ccp, int lane, int op, 
+                     qint64 OpStats::*counter, qint64 n)
+{
+    atomic_add(&((ccp->stats.st_lanes)[lane].ls_totals.*counter), n);
+    if(op >= 0 && op < STAT_OPS)
+        atomic_add(&((ccp->stats.st_ops)[op].*counter), n);
+}
+
+/* ---------- Data Arena ---------- */
+
+static void arena_push(CommCenterPrivate *ccp, qint64 first, qint64 last,
+                       int count)
+{
+    qint64 top;
+
+    do
+    {
+        top = atomic_load(&ccp->arena_free);
+        atomic_store(&(ccp->arena_next)[last], top & ARENA_NONE);
+    } while(!atomic_cas(&ccp->arena_free, top, ARENA_TOP(top, first)));
+
+    __sync_fetch_and_add(&ccp->arena_avail, (qint64)count);
+}
+
+static qint64 arena_pop(CommCenterPrivate *ccp)
+{
+    qint64 top, idx, next;
+
+    for(;;)
+    {
+        top = atomic_load(&ccp->arena_free);
+        idx = top & ARENA_NONE;
+        if(idx == ARENA_NONE)
+            return -1;
+
+        next = atomic_load(&(ccp->arena_next)[idx]);
+        if(atomic_cas(&ccp->arena_free, top, 
+                      ARENA_TOP(top, next & ARENA_NONE)))
+        {
+            atomic_min(&ccp->stats.st_arena_low, 
+                       atomic_dec(&ccp->arena_avail));
+            return idx;
+        }
+    }
+}
+
+/* Hand the count blocks chained from first back to the arena. */
+static void arena_release(CommCenterPrivate *ccp, qint64 first, int count)
+{
+    qint64 last = first;
+    int i;
+
+    if(first < 0 || count <= 0)
         return;
+
+    for(i = 1; i < count; i++)
+    {
+        last = (ccp->arena_next)[last];
+    }
+
+    arena_push(ccp, first, last, count);
+}
+
+/* ---------- Message Buffers ---------- */
+
+/* Received messages are kept in buffers which count the views referring to
+ * them.  Buffers big enough for a typical message are kept on a free list
+ * when released, anything larger goes back to the heap.
+ */
+struct MessageBuffer
+{
+    int mb_refs;
+    int mb_capacity;                /* Bytes available from msg_data on. */
+    struct MessageBuffer *mb_next;  /* Next buffer in the pool. */
+    struct Message mb_msg;          /* MUST be last. */
+};
+
+#define POOL_BUFFER_SIZE  1024      /* Data capacity of pooled buffers. */
+#define POOL_MAX_BUFFERS  128       /* Most buffers kept in the pool. */
+
+static QMutex pool_lock;
+static struct MessageBuffer *pool_free = NULL;
+static int pool_count = 0;
+
+static struct MessageBuffer *buffer_get(qint64 size)
+{
+    struct MessageBuffer *buf = NULL;
+    qint64 capacity = POOL_BUFFER_SIZE;
+
+    if(size + 1 <= POOL_BUFFER_SIZE)
+    {
+        pool_lock.lock();
+        buf = pool_free;
+        if(buf != NULL)
+        {
+            pool_free = buf->mb_next;
+            pool_count--;
+        }
+        pool_lock.unlock();
+    }
+    else
+    {
+        capacity = size + 1;
     }
 
-    if(sharedMemory.create(SHM_RAILS_SIZE))
+    if(buf == NULL)
     {
-        sharedMemory.lock();
-        bzero(sharedMemory.data(), SHM_RAILS_SIZE);
-        sharedMemory.unlock();
+        buf = (struct MessageBuffer *)malloc(offsetof(struct MessageBuffer, 
+                                                      mb_msg.msg_data) 
+                                             + capacity);
+        if(buf == NULL)
+            return NULL;
 
-        return;
+        buf->mb_capacity = capacity;
     }
 
-    qDebug() << "Error: sharedMemory.create() :: " << \
-        sharedMemory.errorString();
-    return;
+    buf->mb_refs = 1;
+    buf->mb_next = NULL;
+    buf->mb_msg.msg_size = size;
+    buf->mb_msg.msg_data[size] = '\0';
+
+    return buf;
 }
 
-CommCenter::~CommCenter()
+static void buffer_ref(struct MessageBuffer *buf)
 {
-    if(sharedMemory.detach() == false)
+    __sync_add_and_fetch(&buf->mb_refs, 1);
+}
+
+static void buffer_unref(struct MessageBuffer *buf)
+{
+    if(buf == NULL || __sync_sub_and_fetch(&buf->mb_refs, 1) != 0)
+        return;
+
+    if(buf->mb_capacity == POOL_BUFFER_SIZE)
     {
-        qDebug() << "dtor: failed to detach";
-        qDebug() << "dtor: isAttached = " << sharedMemory.isAttached();
+        pool_lock.lock();
+        if(pool_count < POOL_MAX_BUFFERS)
+        {
+            buf->mb_next = pool_free;
+            pool_free = buf;
+            pool_count++;
+            buf = NULL;
+        }
+        pool_lock.unlock();
     }
+
+    free(buf);
 }
 
-bool CommCenter::connect()
+/* Copy a message's header and the data in its blocks out of the arena.  The
+ * blocks may be recycled while this is going on, so the chain is followed
+ * with care and the caller MUST check the slot is unchanged afterwards.
+ */
+static struct MessageBuffer *copy_message(CommCenterPrivate *ccp, 
+                                          const struct Message *hdr, 
+                                          qint64 block)
 {
-    sharedMemory.lock();
-    CommCenterPrivate *ccp = (CommCenterPrivate *)sharedMemory.constData();
-    connection_id = ccp->next_id;
-    ccp->next_id += 1;
-    ccp->nobservers += 1;
-    sharedMemory.unlock();
+    struct MessageBuffer *buf;
+    qint64 done, len;
 
-    connected = true;
+    if(hdr->msg_size < 0 || hdr->msg_size > MSG_FRAG_SIZE)
+        return NULL;
 
-    return true;
+    buf = buffer_get(hdr->msg_size);
+    if(buf == NULL)
+        return NULL;
+
+    memcpy(&buf->mb_msg, hdr, offsetof(struct Message, msg_data));
+
+    for(done = 0; done < hdr->msg_size; done += len)
+    {
+        if(block < 0 || block >= MSG_MAX_BLOCKS)
+        {
+            buffer_unref(buf);
+            return NULL;
+        }
+
+        len = qMin((qint64)MSG_BLOCK_SIZE, hdr->msg_size - done);
+        memcpy(buf->mb_msg.msg_data + done, (ccp->arena)[block], len);
+        block = atomic_load(&(ccp->arena_next)[block]);
+    }
+
+    return buf;
 }
 
-bool CommCenter::disconnect()
+/* Move a published slot on to next_seq, returning its blocks to the arena
+ * if we were the one to do so.
+ */
+static bool retire_slot(CommCenterPrivate *ccp, struct MsgLane *mlp,
+                        struct MsgSlot *slot, qint64 seq, qint64 next_seq)
 {
-    if(connected == false)
+    struct MsgRoute *route = &((mlp->ring_route)[slot - mlp->ring]);
+    qint64 block = slot->slot_block;
+    qint64 pending = PENDING_COUNT(slot->slot_pending);
+    qint64 op = route->route_op;
+    int count = BLOCK_COUNT(slot->slot_size);
+
+    if(!atomic_cas(&slot->slot_seq, seq, next_seq))
         return false;
 
-    sharedMemory.lock();
-    CommCenterPrivate *ccp = (CommCenterPrivate *)sharedMemory.data();
-    ccp->nobservers -= 1;
-    sharedMemory.unlock();
+    atomic_dec(&mlp->ring_depth);
+    arena_release(ccp, block, count);
 
-    connected = false;
+    /* whoever had not read the message by now never will */
+    if(pending > 0 && op >= 0)
+        stat_add(ccp, mlp - ccp->lanes, op, &OpStats::os_expired, pending);
 
     return true;
 }
 
-void CommCenter::broadcast(const QByteArray & msg_ba)
+/* Mark the message published at pos as read by connection id and retire
+ * the slot if that was the last reader it was addressed to.  Callers look
+ * at the slot before calling, so it may have been retired, and even 
+ * claimed for the next lap, since.  The pending count carries the 
+ * sequence, see PENDING_WORD(), so that a stale reader never counts down 
+ * somebody else's message.
+ */
+static void mark_read(CommCenterPrivate *ccp, struct MsgLane *mlp, 
+                      qint64 pos, int id)
 {
-    // qDebug() << "bcast: " << msg_ba;
+    struct MsgSlot *slot = &((mlp->ring)[pos & MSG_RING_MASK]);
+    struct MsgRoute *route = &((mlp->ring_route)[pos & MSG_RING_MASK]);
+    qint64 *read = &(route->route_read)[PEER_WORD(id)];
+    qint64 bit = PEER_BIT(id);
+    qint64 seq = pos + 1;
+    qint64 word;
+
+    if(atomic_load(&slot->slot_seq) != seq)
+        return;
+
+    if((atomic_load(&(route->route_expect)[PEER_WORD(id)]) & bit) == 0)
+        return;
+
+    if((atomic_set_bits(read, bit) & bit) != 0)
+        return;
+
+    /* The count is only lowered while it is still tagged with seq.  If it
+     * isn't the slot has moved on and the bit may have landed on the next
+     * lap's message, which we have not read.
+     */
+    do
+    {
+        word = atomic_load(&slot->slot_pending);
+        if(word != PENDING_WORD(seq, PENDING_COUNT(word)) || 
+           PENDING_COUNT(word) == 0)
+        {
+            atomic_clear_bits(read, bit);
+            return;
+        }
+    } while(!atomic_cas(&slot->slot_pending, word, word - 1));
 
-    sharedMemory.lock();
-    postMessage(0, msg_ba);
-    sharedMemory.unlock();
+    if(PENDING_COUNT(word) == 1)
+        retire_slot(ccp, mlp, slot, seq, pos + MSG_MAX_COUNT);
 }
 
-void CommCenter::send(qint64 dst_pid, const QByteArray & msg_ba)
+/* Time a message sent now that may live for lifetime_ms expires at. */
+static qint64 message_expiry(int lifetime_ms)
 {
-    // qDebug() << "send [" << dst_pid<< "]: " << msg_ba;
+    if(lifetime_ms <= 0 || lifetime_ms > MSG_TIME_EXPR)
+        lifetime_ms = MSG_TIME_EXPR;
 
-    sharedMemory.lock();
-    postMessage(dst_pid, msg_ba);
-    sharedMemory.unlock();
+    return QDateTime::currentMSecsSinceEpoch() + lifetime_ms;
 }
 
-/* ---------- Utility Functions ---------- */
-
-bool CommCenter::isConnected()
+/* The slot for pos has been claimed but not published.  If its producer
+ * has died, or has been at it for longer than a message may live, the 
+ * position is retired unpublished so that the next lap can use the slot,
+ * and the blocks the producer took are returned.  With force set the 
+ * caller has already decided the producer is gone, which covers one that
+ * died before it recorded its claim.  Returns true if the position has 
+ * been retired, by us or anyone else.
+ */
+static bool retire_claim(CommCenterPrivate *ccp, struct MsgLane *mlp,
+                         qint64 pos, bool force)
 {
-    return connected;
+    struct MsgSlot *slot = &((mlp->ring)[pos & MSG_RING_MASK]);
+    struct MsgRoute *route = &((mlp->ring_route)[pos & MSG_RING_MASK]);
+    qint64 pid, since, block, size;
+    bool recorded;
+
+    recorded = (atomic_load(&route->route_claim_pos) == pos);
+    pid = route->route_claim_pid;
+    since = route->route_claim_time;
+    block = slot->slot_block;
+    size = slot->slot_size;
+
+    if(atomic_load(&slot->slot_seq) != pos)
+        return atomic_load(&slot->slot_seq) >= pos + MSG_MAX_COUNT;
+
+    if(!force)
+    {
+        if(!recorded)
+            return false;
+
+        if(process_alive(pid) && 
+           QDateTime::currentMSecsSinceEpoch() - since < MSG_TIME_EXPR)
+            return false;
+    }
+
+    if(!atomic_cas(&slot->slot_seq, pos, pos + MSG_MAX_COUNT))
+        return atomic_load(&slot->slot_seq) >= pos + MSG_MAX_COUNT;
+
+    if(recorded)
+        arena_release(ccp, block, BLOCK_COUNT(size));
+
+    atomic_inc(&ccp->stats.st_stale_claims);
+    return true;
 }
 
-struct Message *CommCenter::readMessage(int msg_box)
+/* Called by a producer that found no room for its message.  Sleeps for a
+ * moment so readers can catch up, unless it has already waited until 
+ * wait_until in which case it returns false.
+ */
+static bool wait_for_room(CommCenterPrivate *ccp, qint64 wait_until)
 {
-    CommCenterPrivate *ccp;
-    struct Message *shm_msgp;
-    struct Message *priv_msgp;
-    qint64 curr_time_ms, pid;
+    if(QDateTime::currentMSecsSinceEpoch() >= wait_until)
+        return false;
 
-    sharedMemory.lock();
-    ccp = (CommCenterPrivate *)sharedMemory.data();
+    atomic_inc(&ccp->stats.st_room_waits);
+    usleep(MSG_WAIT_USECS);
+    return true;
+}
+
+/* Lay out a segment that is not ready yet.  Called with the sharedMemory
+ * lock held.
+ */
+static void init_segment(CommCenterPrivate *ccp)
+{
+    if(atomic_load(&ccp->init_done) == SHM_RAILS_READY)
+        return;
 
-    shm_msgp = &((ccp->msgs)[msg_box]);
+    bzero(ccp, SHM_RAILS_SIZE);
 
-    /* check if there is a message in this box */
-    if(shm_msgp->msg_time == 0)
+    for(int lane = 0; lane < MSG_LANES; lane++)
     {
-        goto rm_error;
+        for(int i = 0; i < MSG_MAX_COUNT; i++)
+        {
+            ccp->lanes[lane].ring[i].slot_seq = i;
+            ccp->lanes[lane].ring[i].slot_block = -1;
+            ccp->lanes[lane].ring_route[i].route_claim_pos = -1;
+        }
     }
 
-    /* check if we need to read it */
-    pid = QCoreApplication::applicationPid();
-    if(shm_msgp->msg_from == pid)
+    for(int i = 0; i < MSG_MAX_BLOCKS; i++)
     {
-        goto rm_error;
+        ccp->arena_next[i] = i + 1;
     }
+    ccp->arena_next[MSG_MAX_BLOCKS - 1] = ARENA_NONE;
+    ccp->arena_free = 0;
+    ccp->arena_avail = MSG_MAX_BLOCKS;
+    ccp->stats.st_arena_low = MSG_MAX_BLOCKS;
 
-    if(shm_msgp->msg_to != 0 && shm_msgp->msg_to != pid)
+    for(int i = 0; i < MSG_MAX_PEERS; i++)
     {
-        goto rm_error;
+        ccp->peers[i].pe_next_free = i + 1;
     }
+    ccp->peers[MSG_MAX_PEERS - 1].pe_next_free = -1;
+    ccp->roster_free = 0;
 
-    /* check if message lifetime has expired */
-    curr_time_ms = QDateTime::currentMSecsSinceEpoch();
-    if((curr_time_ms - shm_msgp->msg_time) >= MSG_TIME_EXPR)
+    /* everything above must be visible before this is */
+    atomic_store(&ccp->init_done, SHM_RAILS_READY);
+}
+
+CommCenter::CommCenter(QObject * parent)
+    : QObject(parent), connected(false), connection_id(-1), 
+      lease_time(0), roster_seen(-1),
+      doorbell(NULL),
+      wakeup_pending(false), next_id(1), sharedMemory(SHM_RAILS_KEY)
+{
+    CommCenterPrivate *ccp;
+
+    for(int lane = 0; lane < MSG_LANES; lane++)
     {
-        bzero(shm_msgp, sizeof(struct Message));
-        goto rm_error;
+        read_pos[lane] = 0;
+        stall_pos[lane] = -1;
+        stall_since[lane] = 0;
     }
 
-    /* check if previously read the message */
-    if((shm_msgp->msg_read & (0x1 << connection_id)) != 0)
+    if(!sharedMemory.attach())
     {
-        goto rm_error;
+        if(sharedMemory.error() != QSharedMemory::NotFound)
+        {
+            qDebug() << "Error: sharedMemory.attach() :: " << \
+                sharedMemory.errorString();
+            return;
+        }
+
+        if(!sharedMemory.create(SHM_RAILS_SIZE))
+        {
+            qDebug() << "Error: sharedMemory.create() :: " << \
+                sharedMemory.errorString();
+            return;
+        }
     }
-    
-    /* read the message */
-    priv_msgp = (struct Message *)calloc(1, sizeof(struct Message));
-    if(priv_msgp == NULL)
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+    if(ccp == NULL)
     {
-        goto rm_error;
+        qDebug() << "Error: sharedMemory.data() :: " << \
+            sharedMemory.errorString();
+        sharedMemory.detach();
+        return;
     }
 
-    memcpy(priv_msgp, shm_msgp, sizeof(struct Message));
+    /* a segment left behind by a build with a different layout is too 
+     * small to lay out again in place
+     */
+    if((size_t)sharedMemory.size() < SHM_RAILS_SIZE)
+    {
+        qDebug() << "Error: sharedMemory.size() :: " << \
+            sharedMemory.size() << " bytes, expected " << \
+            (int)SHM_RAILS_SIZE << ".  Is another version of Rails running?";
+        sharedMemory.detach();
+        return;
+    }
 
-    /* mark the message as read */
-    shm_msgp->msg_read |= (0x1 << connection_id);
+    /* an attacher can get here while the creator is still laying the 
+     * segment out, the lock makes it wait until it is done
+     */
+    if(atomic_load(&ccp->init_done) != SHM_RAILS_READY)
+    {
+        sharedMemory.lock();
+        init_segment(ccp);
+        sharedMemory.unlock();
+    }
+}
 
-    sharedMemory.unlock();
-    return priv_msgp;
+CommCenter::~CommCenter()
+{
+    finishCalls();
 
-rm_error:
-    sharedMemory.unlock();
-    return NULL;
+    if(sharedMemory.detach() == false)
+    {
+        qDebug() << "dtor: failed to detach";
+        qDebug() << "dtor: isAttached = " << sharedMemory.isAttached();
+    }
 }
 
-/* CommCenter::postMessage() must be entered with the 
- * sharedMemory lock already in place.
- */
-void CommCenter::postMessage(qint64 dst_pid, const QByteArray & msg_ba)
+bool CommCenter::connect(const QString & name)
 {
-    CommCenterPrivate *ccp;
-    struct Message *msgs;
-    struct Message *mailbox;
-    int msgBox;
-    
-    ccp = (CommCenterPrivate *)sharedMemory.data();
-    
-    msgBox = nextMsgBox(ccp);
-    if(msgBox < 0)
+    qint64 pid = QCoreApplication::applicationPid();
+    QString doorbell_name = QString(DOORBELL_PREFIX) + QString::number(pid);
+
+    /* a stale socket may have been left behind by a crashed instance 
+     * that had the same process ID
+     */
+    QLocalServer::removeServer(doorbell_name);
+
+    if(sharedMemory.data() == NULL)
     {
-        qDebug() << "Warning: Message boxes are full.  Skipping message.";
-        return;
+        qDebug() << "Warning: not attached to the shared memory region";
+        return false;
+    }
+
+    doorbell = new QLocalServer(this);
+    QObject::connect(doorbell, SIGNAL(newConnection()),
+                     this, SLOT(doorbellConnection()));
+    if(!doorbell->listen(doorbell_name))
+    {
+        qDebug() << "Warning: doorbell->listen() :: " << \
+            doorbell->errorString();
     }
 
-    msgs = ccp->msgs;
-    mailbox = &(msgs[msgBox]);
+    peer_name = name;
+    if(!joinRoster())
+    {
+        qDebug() << "Warning: Could not join the peer table.  "
+            "Not connecting.";
+        delete doorbell;
+        doorbell = NULL;
+        return false;
+    }
+
+    /* only messages posted from now on are of interest */
+    CommCenterPrivate *ccp = (CommCenterPrivate *)sharedMemory.data();
+    for(int lane = 0; lane < MSG_LANES; lane++)
+    {
+        read_pos[lane] = atomic_load(&(ccp->lanes)[lane].ring_head);
+        stall_pos[lane] = -1;
+    }
 
-    mailbox->msg_time = QDateTime::currentMSecsSinceEpoch();
-    mailbox->msg_read = 0;
-    mailbox->msg_from = QCoreApplication::applicationPid();;
-    mailbox->msg_to   = dst_pid;
+    connected = true;
 
-    memcpy(mailbox->msg_data, msg_ba.data(), 
-           qMin(msg_ba.size(), MSG_DATA_SIZE));    
+    return true;
 }
 
-int CommCenter::nextMsgBox(void *vccp)
+bool CommCenter::disconnect()
 {
-    CommCenterPrivate *ccp;
-    struct Message *msgs_p;
-    int msgBox;
+    if(connected == false)
+        return false;
+
+    if(connection_id >= 0)
+        leaveRoster(connection_id, QCoreApplication::applicationPid());
 
-    ccp = (CommCenterPrivate *)vccp;
-    msgs_p = ccp->msgs;
+    finishCalls();
+    purgeFragments(-1);
 
-    for(msgBox = 0; msgBox < MSG_MAX_COUNT; msgBox++)
+    connection_id = -1;
+    roster_seen = -1;
+    known_peers.clear();
+    peer_ids.clear();
+
+    QHash<qint64, QLocalSocket *>::iterator i;
+    for(i = doorbells.begin(); i != doorbells.end(); i++)
     {
-        if((msgs_p[msgBox]).msg_time == 0)
-        {
-            return msgBox;
-        }
-        else if((QDateTime::currentMSecsSinceEpoch() - \
-                 (msgs_p[msgBox]).msg_time) >= MSG_TIME_EXPR)
-        {
-            bzero(&(msgs_p[msgBox]), sizeof(struct Message));
-            return msgBox;
-        }
+        i.value()->abort();
+        i.value()->deleteLater();
     }
+    doorbells.clear();
 
-    return -1;
+    if(doorbell != NULL)
+    {
+        doorbell->close();
+        doorbell->deleteLater();
+        doorbell = NULL;
+    }
+
+    connected = false;
+
+    return true;
 }
 
-int CommCenter::observers()
+bool CommCenter::broadcast(const QByteArray & msg_ba)
 {
-    int obs = -1;
+    // qDebug() << "bcast: " << msg_ba;
 
-    sharedMemory.lock();
-    CommCenterPrivate *ccp = (CommCenterPrivate *)sharedMemory.data();
-    obs = ccp->nobservers;
-    sharedMemory.unlock();
+    return sendWait(0, msg_ba, 0) == PostOk;
+}
+
+bool CommCenter::send(qint64 dst_pid, const QByteArray & msg_ba)
+{
+    // qDebug() << "send [" << dst_pid<< "]: " << msg_ba;
 
-    return obs;
+    return sendWait(dst_pid, msg_ba, 0) == PostOk;
 }
 
-int CommCenter::pending()
+CommCenter::PostStatus CommCenter::broadcastWait(const QByteArray & msg_ba,
+                                                 int wait_ms, int lifetime_ms,
+                                                 Lane lane)
 {
-    int pnd = -1;
-    return pnd;
+    return sendWait(0, msg_ba, wait_ms, lifetime_ms, lane);
 }
 
-QStringList CommCenter::allMessages()
+CommCenter::PostStatus CommCenter::sendWait(qint64 dst_pid, 
+                                            const QByteArray & msg_ba,
+                                            int wait_ms, int lifetime_ms,
+                                            Lane lane)
 {
-    QStringList msgs;
-    int i;
+    qint64 expect[MSG_PEER_WORDS];
+    PostStatus status;
 
-    sharedMemory.lock();
-    CommCenterPrivate *ccp = (CommCenterPrivate *)sharedMemory.data();
-    struct Message *msgp = ccp->msgs;
+    status = postMessage(lane, dst_pid, msg_ba, next_id++, 0, false,
+                         message_expiry(lifetime_ms), wait_ms, expect);
+    if(status == PostOk)
+        ringDoorbells(expect);
 
-    QString builder;
-    for(i = 0; i < MSG_MAX_COUNT; i++)
-    {
-        builder.sprintf("[%d] time: %lld, read: %lld, "
-                        "from: %lld, to: %lld -> %s"
-                        , i
-                        , (msgp[i]).msg_time, (msgp[i]).msg_read
-                        , (msgp[i]).msg_from, (msgp[i]).msg_to
-                        , (char *)((msgp[i]).msg_data));
-        msgs << builder;
-    }
+    return status;
+}
 
-    sharedMemory.unlock();
+const char *CommCenter::statusString(PostStatus status)
+{
+    switch(status)
+    {
+    case PostOk:
+        return "Message posted";
+    case PostTooLarge:
+        return "Message too large";
+    case PostRingFull:
+        return "Message boxes are full";
+    case PostArenaFull:
+        return "Message arena is full";
+    case PostNotConnected:
+        return "Not connected";
+    }
 
-    return msgs;
+    return "Unknown status";
 }
 
-/* ---------- Private Slots ---------- */
+CommReply *CommCenter::call(qint64 dst_pid, const QByteArray & msg_ba,
+                            int timeout_ms, Lane lane)
+{
+    qint64 expect[MSG_PEER_WORDS];
+    qint64 msg_id;
+    int i, count;
+
+    msg_id = next_id++;
+    if(postMessage(lane, dst_pid, msg_ba, msg_id, 0, false,
+                   message_expiry(timeout_ms), 0, expect) != PostOk)
+        return NULL;
+
+    count = 0;
+    for(i = 0; i < MSG_PEER_WORDS; i++)
+    {
+        count += __builtin_popcountll(expect[i]);
+    }
+
+    CommReply *reply = new CommReply(this, msg_id, count, timeout_ms);
+    calls.insert(msg_id, reply);
+
+    ringDoorbells(expect);
+    return reply;
+}
+
+bool CommCenter::reply(const struct Message *request, const QByteArray & msg_ba,
+                       bool more)
+{
+    qint64 expect[MSG_PEER_WORDS];
+    qint64 expire;
+
+    /* nobody will be waiting for the reply once the request has expired */
+    expire = request->msg_expire;
+    if(expire <= 0)
+        expire = message_expiry(0);
+
+    /* replies travel in the lane the request came in */
+    if(postMessage((int)request->msg_lane, request->msg_from, msg_ba, 
+                   next_id++, request->msg_id, more, expire, 0, 
+                   expect) != PostOk)
+        return false;
+
+    ringDoorbells(expect);
+    return true;
+}
+
+/* ---------- Utility Functions ---------- */
+
+bool CommCenter::isConnected()
+{
+    return connected;
+}
+
+MessageView CommCenter::readView()
+{
+    MessageView view;
+    int lane;
+
+    for(lane = 0; lane < MSG_LANES; lane++)
+    {
+        view = readLane(lane);
+        if(!view.isNull())
+            break;
+    }
+
+    return view;
+}
+
+MessageView CommCenter::readLane(int lane)
+{
+    CommCenterPrivate *ccp;
+    struct MsgLane *mlp;
+    struct MsgSlot *slot;
+    struct MsgRoute *route;
+    struct Message msg;
+    struct MessageBuffer *buf;
+    qint64 curr_time_ms, pid, pos, seq, head, block, offset, total, op;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+    mlp = &(ccp->lanes)[lane];
+    pid = QCoreApplication::applicationPid();
+
+    for(;;)
+    {
+        pos = read_pos[lane];
+        slot = &((mlp->ring)[pos & MSG_RING_MASK]);
+        seq = atomic_load(&slot->slot_seq);
+
+        if(seq <= pos)
+        {
+            /* nothing has been published at this position yet */
+            head = atomic_load(&mlp->ring_head);
+            if(head <= pos)
+            {
+                /* Ask for a doorbell and check again in case something 
+                 * was posted before the request was seen.
+                 */
+                if(connection_id < 0)
+                    return MessageView();
+
+                if((atomic_set_bits(&(ccp->roster_armed)[
+                                        PEER_WORD(connection_id)],
+                                    PEER_BIT(connection_id)) & 
+                    PEER_BIT(connection_id)) != 0)
+                    return MessageView();
+
+                if(atomic_load(&mlp->ring_head) <= pos)
+                    return MessageView();
+
+                continue;
+            }
+
+            /* The position has been claimed but not published.  Give the
+             * producer a chance to finish; if it has died, or never does,
+             * the position is retired so that the slot isn't lost to 
+             * later laps, and skipped.
+             */
+            if(retire_claim(ccp, mlp, pos, false))
+            {
+                read_pos[lane]++;
+                continue;
+            }
+
+            /* ask for a doorbell when it is published, then check again in
+             * case that happened before the request was seen
+             */
+            if(connection_id >= 0)
+            {
+                atomic_set_bits(&(ccp->roster_armed)[PEER_WORD(connection_id)],
+                                PEER_BIT(connection_id));
+            }
+
+            if(atomic_load(&slot->slot_seq) != pos)
+                continue;
+
+            curr_time_ms = QDateTime::currentMSecsSinceEpoch();
+            if(stall_pos[lane] != pos)
+            {
+                stall_pos[lane] = pos;
+                stall_since[lane] = curr_time_ms;
+                return MessageView();
+            }
+
+            if((curr_time_ms - stall_since[lane]) < MSG_TIME_EXPR)
+                return MessageView();
+
+            retire_claim(ccp, mlp, pos, true);
+            read_pos[lane]++;
+            continue;
+        }
+
+        if(seq != pos + 1)
+        {
+            /* the slot has moved on to a later lap, we missed this one */
+            head = atomic_load(&mlp->ring_head);
+            read_pos[lane] = qMax(pos + 1, head - MSG_MAX_COUNT);
+            continue;
+        }
+
+        /* copy the header out and make sure the slot wasn't recycled
+         * while we were doing so
+         */
+        msg.msg_expire = slot->slot_expire;
+        msg.msg_lane = lane;
+        msg.msg_from = slot->slot_from;
+        msg.msg_to = slot->slot_to;
+        msg.msg_id = slot->slot_id;
+        msg.msg_pending = PENDING_COUNT(slot->slot_pending);
+        msg.msg_size = slot->slot_size;
+        block = slot->slot_block;
+        if(atomic_load(&slot->slot_seq) != seq)
+        {
+            read_pos[lane]++;
+            continue;
+        }
+
+        read_pos[lane]++;
+
+        /* check if we need to read it */
+        if(msg.msg_from == pid)
+            continue;
+
+        if(msg.msg_to != 0 && msg.msg_to != pid)
+            continue;
+
+        /* Check if message lifetime has expired.  It is marked as read so
+         * that the slot is freed up as soon as everyone has seen it rather
+         * than sitting there until a producer needs it.
+         */
+        curr_time_ms = QDateTime::currentMSecsSinceEpoch();
+        if(curr_time_ms >= msg.msg_expire)
+        {
+            route = &((mlp->ring_route)[pos & MSG_RING_MASK]);
+            op = route->route_op;
+            if(connection_id >= 0 && atomic_load(&slot->slot_seq) == seq)
+            {
+                mark_read(ccp, mlp, pos, connection_id);
+                if(op >= 0)
+                    stat_add(ccp, lane, op, &OpStats::os_expired, 1);
+            }
+            continue;
+        }
+
+        /* the message is for us, the rest of the entry is of interest */
+        route = &((mlp->ring_route)[pos & MSG_RING_MASK]);
+        msg.msg_time = route->route_time;
+        msg.msg_reply_to = route->route_reply_to;
+        msg.msg_more = route->route_more;
+        offset = route->route_offset;
+        total = route->route_total;
+        memcpy(msg.msg_expect, route->route_expect, sizeof(msg.msg_expect));
+        memcpy(msg.msg_read, route->route_read, sizeof(msg.msg_read));
+
+        /* replies go to the call that is waiting for them, if it still is */
+        QHash<qint64, CommReply *>::iterator call_it = calls.end();
+        if(msg.msg_reply_to != 0)
+        {
+            call_it = calls.find(msg.msg_reply_to);
+            if(call_it == calls.end())
+            {
+                if(connection_id >= 0 && 
+                   atomic_load(&slot->slot_seq) == seq)
+                    mark_read(ccp, mlp, pos, connection_id);
+                continue;
+            }
+        }
+
+        /* read the message, the slot must not have been recycled before
+         * we mark it as read
+         */
+        buf = copy_message(ccp, &msg, block);
+        if(atomic_load(&slot->slot_seq) != seq)
+        {
+            buffer_unref(buf);
+            continue;
+        }
+
+        if(connection_id >= 0)
+        {
+            mark_read(ccp, mlp, pos, connection_id);
+            if(buf != NULL)
+                buf->mb_msg.msg_read[PEER_WORD(connection_id)] |= 
+                    PEER_BIT(connection_id);
+        }
+
+        if(buf == NULL)
+            continue;
+
+        if(offset != 0 || total != msg.msg_size)
+        {
+            buf = reassemble(buf, offset, total);
+            if(buf == NULL)
+                continue;
+        }
+
+        stat_add(ccp, lane, message_op(buf->mb_msg.msg_data, 
+                                       buf->mb_msg.msg_size),
+                 &OpStats::os_delivered, 1);
+        if(connection_id >= 0)
+            atomic_inc(&((ccp->peers)[connection_id].pe_received));
+
+        if(call_it != calls.end())
+        {
+            call_it.value()->deliver(MessageView(buf));
+            continue;
+        }
+
+        return MessageView(buf);
+    }
+}
+
+int CommCenter::readMessages(QList<MessageView> & msgs, int max_msgs)
+{
+    MessageView view;
+    int count = 0;
+
+    if(connected)
+        maintainRoster();
+
+    if(!fragments.isEmpty())
+        purgeFragments(QDateTime::currentMSecsSinceEpoch());
+
+    while(max_msgs < 0 || count < max_msgs)
+    {
+        view = readView();
+        if(view.isNull())
+            break;
+
+        msgs.append(view);
+        count++;
+    }
+
+    return count;
+}
+
+/* Copy a message out of its view into memory the caller can free(). */
+static struct Message *detach_message(const MessageView & view)
+{
+    struct Message *msgp;
+    size_t size;
+
+    size = offsetof(struct Message, msg_data) + view->msg_size + 1;
+    msgp = (struct Message *)malloc(size);
+    if(msgp != NULL)
+        memcpy(msgp, view.message(), size);
+
+    return msgp;
+}
+
+struct Message *CommCenter::readMessage()
+{
+    MessageView view = readView();
+
+    if(view.isNull())
+        return NULL;
+
+    return detach_message(view);
+}
+
+int CommCenter::readMessages(QList<struct Message *> & msgs, int max_msgs)
+{
+    QList<MessageView> views;
+    struct Message *msgp;
+    int i, count = 0;
+
+    readMessages(views, max_msgs);
+    for(i = 0; i < views.size(); i++)
+    {
+        msgp = detach_message(views.at(i));
+        if(msgp == NULL)
+            continue;
+
+        msgs.append(msgp);
+        count++;
+    }
+
+    return count;
+}
+
+/* Messages larger than MSG_FRAG_SIZE are posted as a run of fragments which
+ * share the msg_id of the whole message.
+ */
+CommCenter::PostStatus CommCenter::postMessage(int lane, qint64 dst_pid, 
+                                               const QByteArray & msg_ba,
+                                               qint64 msg_id, qint64 reply_to,
+                                               bool more, qint64 expire, 
+                                               int wait_ms,
+                                               qint64 *expect_out)
+{
+    CommCenterPrivate *ccp;
+    qint64 offset, size, total, wait_until;
+    PostStatus status;
+
+    if(!connected)
+        return PostNotConnected;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+
+    total = msg_ba.size();
+    if(total > MSG_MAX_SIZE)
+    {
+        qDebug() << "Warning: Message too large.  Skipping message.";
+        stat_add(ccp, lane, message_op(msg_ba.constData(), total),
+                 &OpStats::os_dropped, 1);
+        return PostTooLarge;
+    }
+
+    /* there is no point waiting for room past the message's deadline */
+    wait_until = QDateTime::currentMSecsSinceEpoch() + qMax(wait_ms, 0);
+    wait_until = qMin(wait_until, expire);
+
+    offset = 0;
+    do
+    {
+        size = qMin(total - offset, (qint64)MSG_FRAG_SIZE);
+        status = postFragment(lane, dst_pid, msg_ba.constData() + offset, 
+                              size, offset, total, msg_id, reply_to, more,
+                              expire, wait_until, expect_out);
+        if(status != PostOk)
+            break;
+
+        offset += size;
+    } while(offset < total);
+
+    stat_add(ccp, lane, message_op(msg_ba.constData(), total),
+             status == PostOk ? &OpStats::os_posted : &OpStats::os_dropped, 1);
+
+    return status;
+}
+
+CommCenter::PostStatus CommCenter::postFragment(int lane, qint64 dst_pid, 
+                                                const char *data, qint64 size,
+                                                qint64 offset, qint64 total,
+                                                qint64 msg_id, qint64 reply_to,
+                                                bool more, qint64 expire, 
+                                                qint64 wait_until,
+                                                qint64 *expect_out)
+{
+    CommCenterPrivate *ccp;
+    struct MsgLane *mlp;
+    struct MsgSlot *slot;
+    struct MsgRoute *route;
+    qint64 pos, seq, msg_expire, pending, block, first_block, done, len;
+    int busy_spins = 0;
+    
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+    mlp = &(ccp->lanes)[lane];
+
+    /* the data is written before a slot is claimed so that readers are 
+     * kept waiting on the slot for as short a time as possible
+     */
+    for(;;)
+    {
+        first_block = allocBlocks(lane, BLOCK_COUNT(size));
+        if(size == 0 || first_block >= 0)
+            break;
+
+        if(!wait_for_room(ccp, wait_until))
+        {
+            qDebug() << "Warning: Message arena is full.  Skipping message.";
+            return PostArenaFull;
+        }
+    }
+
+    block = first_block;
+    for(done = 0; done < size; done += len)
+    {
+        len = qMin((qint64)MSG_BLOCK_SIZE, size - done);
+        memcpy((ccp->arena)[block], data + done, len);
+        block = (ccp->arena_next)[block];
+    }
+
+    for(;;)
+    {
+        pos = atomic_load(&mlp->ring_head);
+        slot = &((mlp->ring)[pos & MSG_RING_MASK]);
+        seq = atomic_load(&slot->slot_seq);
+
+        if(seq == pos)
+        {
+            /* slot is free for this position, try to claim it */
+            if(atomic_cas(&mlp->ring_head, pos, pos + 1))
+                break;
+
+            atomic_inc(&ccp->stats.st_head_retries);
+        }
+        else if(seq == pos - MSG_MAX_COUNT + 1)
+        {
+            /* Slot still holds the message from the previous lap.  It can
+             * be retired once all of its readers are done with it or, if
+             * one of them has gone away without reading it, once it has 
+             * expired.
+             */
+            msg_expire = slot->slot_expire;
+            pending = PENDING_COUNT(slot->slot_pending);
+            if(atomic_load(&slot->slot_seq) != seq)
+                continue;
+
+            if(pending > 0 && 
+               QDateTime::currentMSecsSinceEpoch() < msg_expire)
+            {
+                if(wait_for_room(ccp, wait_until))
+                    continue;
+
+                qDebug() << "Warning: Message boxes are full.  "
+                    "Skipping message.";
+                arena_release(ccp, first_block, BLOCK_COUNT(size));
+                return PostRingFull;
+            }
+
+            retire_slot(ccp, mlp, slot, seq, pos);
+        }
+        else if(seq == pos - MSG_MAX_COUNT)
+        {
+            /* The previous lap has been claimed but not yet published.  The
+             * producer is most likely in the middle of writing it so give
+             * it a moment before giving up, unless it is gone.
+             */
+            if(retire_claim(ccp, mlp, pos - MSG_MAX_COUNT, false))
+                continue;
+
+            if(++busy_spins > MSG_BUSY_SPINS)
+            {
+                busy_spins = 0;
+                if(wait_for_room(ccp, wait_until))
+                    continue;
+
+                qDebug() << "Warning: Message boxes are full.  "
+                    "Skipping message.";
+                arena_release(ccp, first_block, BLOCK_COUNT(size));
+                return PostRingFull;
+            }
+
+            atomic_inc(&ccp->stats.st_busy_spins);
+            QThread::yieldCurrentThread();
+        }
+
+        /* otherwise another producer got here first, try again */
+    }
+
+    route = &((mlp->ring_route)[pos & MSG_RING_MASK]);
+
+    /* record the claim first so that the position can be retired, and the
+     * blocks recovered, if we die before publishing
+     */
+    slot->slot_size  = size;
+    slot->slot_block = first_block;
+    route->route_claim_pid = QCoreApplication::applicationPid();
+    route->route_claim_time = QDateTime::currentMSecsSinceEpoch();
+    atomic_store(&route->route_claim_pos, pos);
+
+    bzero(route->route_read, sizeof(route->route_read));
+    slot->slot_pending = PENDING_WORD(pos + 1, 
+                                      expectedReaders(dst_pid, 
+                                                      route->route_expect));
+    memcpy(expect_out, route->route_expect, sizeof(route->route_expect));
+    route->route_time = QDateTime::currentMSecsSinceEpoch();
+    route->route_op = (offset == 0) ? message_op(data, size) : -1;
+    route->route_reply_to = reply_to;
+    route->route_more = more ? 1 : 0;
+    route->route_offset = offset;
+    route->route_total = total;
+
+    slot->slot_expire = expire;
+    slot->slot_from  = QCoreApplication::applicationPid();
+    slot->slot_to    = dst_pid;
+    slot->slot_id    = msg_id;
+
+    /* publish */
+    atomic_max(&((ccp->stats.st_lanes)[lane].ls_depth_peak), 
+               atomic_inc(&mlp->ring_depth));
+    if(!atomic_cas(&slot->slot_seq, pos, pos + 1))
+    {
+        /* we took so long that the position was retired as stale and 
+         * our blocks were returned with it
+         */
+        atomic_dec(&mlp->ring_depth);
+        qDebug() << "Warning: Message position was retired before it was "
+            "published.  Skipping message.";
+        return PostRingFull;
+    }
+
+    return PostOk;
+}
+
+/* Takes count blocks from the arena, chained together, and returns the 
+ * first.  If there aren't enough free blocks expired messages are retired 
+ * to make room before giving up.
+ */
+qint64 CommCenter::allocBlocks(int lane, int count)
+{
+    CommCenterPrivate *ccp;
+    qint64 first, last, block, reserve;
+    int i, tries;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+
+    if(count <= 0)
+        return -1;
+
+    reserve = (lane == LaneBulk) ? MSG_BULK_RESERVE : 0;
+
+    for(tries = 0; tries < 2; tries++)
+    {
+        if(atomic_load(&ccp->arena_avail) - count < reserve)
+        {
+            reclaimExpired();
+            continue;
+        }
+
+        first = last = -1;
+        for(i = 0; i < count; i++)
+        {
+            block = arena_pop(ccp);
+            if(block < 0)
+                break;
+
+            if(last < 0)
+                first = block;
+            else
+                (ccp->arena_next)[last] = block;
+            last = block;
+        }
+
+        if(i == count)
+        {
+            (ccp->arena_next)[last] = ARENA_NONE;
+            return first;
+        }
+
+        if(last >= 0)
+            arena_push(ccp, first, last, i);
+
+        reclaimExpired();
+    }
+
+    return -1;
+}
+
+/* Retire every published message that has either been read by everyone it
+ * was addressed to or has expired, freeing up its blocks.
+ */
+void CommCenter::reclaimExpired()
+{
+    CommCenterPrivate *ccp;
+    struct MsgLane *mlp;
+    struct MsgSlot *slot;
+    qint64 seq, pos, msg_expire, pending, curr_time_ms;
+    int i, lane;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+    curr_time_ms = QDateTime::currentMSecsSinceEpoch();
+
+    for(lane = 0; lane < MSG_LANES; lane++)
+    {
+        mlp = &(ccp->lanes)[lane];
+        for(i = 0; i < MSG_MAX_COUNT; i++)
+        {
+            slot = &((mlp->ring)[i]);
+            seq = atomic_load(&slot->slot_seq);
+            pos = seq - 1;
+            if((pos & MSG_RING_MASK) != i)
+                continue;
+
+            msg_expire = slot->slot_expire;
+            pending = PENDING_COUNT(slot->slot_pending);
+            if(atomic_load(&slot->slot_seq) != seq)
+                continue;
+
+            if(pending > 0 && curr_time_ms < msg_expire)
+                continue;
+
+            retire_slot(ccp, mlp, slot, seq, pos + MSG_MAX_COUNT);
+        }
+    }
+}
+/* Adds a fragment to the message it is part of and returns the message once
+ * it is complete, otherwise NULL.  The fragment is released.
+ */
+struct MessageBuffer *CommCenter::reassemble(struct MessageBuffer *frag, 
+                                             qint64 offset, qint64 total)
+{
+    struct Message *msgp = &frag->mb_msg;
+    QPair<qint64, qint64> key(msgp->msg_from, msgp->msg_id);
+    struct MessageBuffer *buf;
+
+    if(total > MSG_MAX_SIZE || offset < 0 || 
+       offset + msgp->msg_size > total)
+    {
+        buffer_unref(frag);
+        return NULL;
+    }
+
+    Partial & part = fragments[key];
+    if(part.buf == NULL)
+    {
+        part.buf = buffer_get(total);
+        if(part.buf == NULL)
+        {
+            fragments.remove(key);
+            buffer_unref(frag);
+            return NULL;
+        }
+
+        memcpy(&part.buf->mb_msg, msgp, offsetof(struct Message, msg_data));
+        part.buf->mb_msg.msg_size = total;
+        part.started = QDateTime::currentMSecsSinceEpoch();
+    }
+
+    memcpy(part.buf->mb_msg.msg_data + offset, msgp->msg_data, 
+           msgp->msg_size);
+    part.received += msgp->msg_size;
+    buffer_unref(frag);
+
+    if(part.received < total)
+        return NULL;
+
+    buf = part.buf;
+    fragments.remove(key);
+    return buf;
+}
+
+/* Drop messages whose remaining fragments have not turned up in time, or
+ * all of them if now is negative.
+ */
+void CommCenter::purgeFragments(qint64 now)
+{
+    QHash<QPair<qint64, qint64>, Partial>::iterator i;
+
+    i = fragments.begin();
+    while(i != fragments.end())
+    {
+        if(now >= 0 && (now - i.value().started) < MSG_TIME_EXPR)
+        {
+            i++;
+            continue;
+        }
+
+        buffer_unref(i.value().buf);
+        i = fragments.erase(i);
+    }
+}
+
+/* Fills in the set of connections that are expected to read a message sent
+ * to dst_pid, based on who is connected right now, and returns how many 
+ * there are.
+ */
+int CommCenter::expectedReaders(qint64 dst_pid, qint64 *expect)
+{
+    CommCenterPrivate *ccp;
+    int i, id, count;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+    bzero(expect, MSG_PEER_WORDS * sizeof(qint64));
+
+    if(dst_pid != 0)
+    {
+        id = peerIndex(dst_pid);
+        if(id < 0)
+            return 0;
+
+        expect[PEER_WORD(id)] = PEER_BIT(id);
+        return 1;
+    }
+
+    count = 0;
+    for(i = 0; i < MSG_PEER_WORDS; i++)
+    {
+        expect[i] = atomic_load(&(ccp->roster_live)[i]);
+        if(connection_id >= 0 && PEER_WORD(connection_id) == i)
+            expect[i] &= ~PEER_BIT(connection_id);
+
+        count += __builtin_popcountll(expect[i]);
+    }
+
+    return count;
+}
+
+/* Returns the peer table index of the connection belonging to pid, or -1 
+ * if it is not connected.
+ */
+int CommCenter::peerIndex(qint64 pid)
+{
+    CommCenterPrivate *ccp;
+    int id;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+
+    id = peer_ids.value(pid, -1);
+    if(id >= 0 && atomic_load(&(ccp->peers)[id].pe_pid) == pid)
+        return id;
+
+    for(id = 0; id < MSG_MAX_PEERS; id++)
+    {
+        if(atomic_load(&(ccp->peers)[id].pe_pid) == pid)
+        {
+            peer_ids.insert(pid, id);
+            return id;
+        }
+    }
+
+    peer_ids.remove(pid);
+    return -1;
+}
+
+/* Releases the messages connection id has not got around to reading so 
+ * they don't have to wait until they expire to be recycled.  Used when a
+ * peer leaves.
+ */
+void CommCenter::releaseUnread(int id)
+{
+    CommCenterPrivate *ccp;
+    struct MsgLane *mlp;
+    struct MsgSlot *slot;
+    qint64 seq;
+    int i, lane;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+
+    for(lane = 0; lane < MSG_LANES; lane++)
+    {
+        mlp = &(ccp->lanes)[lane];
+        for(i = 0; i < MSG_MAX_COUNT; i++)
+        {
+            slot = &((mlp->ring)[i]);
+            seq = atomic_load(&slot->slot_seq);
+
+            /* only published messages, i.e. seq == pos + 1 */
+            if(((seq - 1) & MSG_RING_MASK) != i)
+                continue;
+
+            mark_read(ccp, mlp, seq - 1, id);
+        }
+    }
+}
+
+/* ---------- Peer Table ---------- */
+
+/* The peer table is read without the lock.  roster_gen works as a 
+ * sequence lock: writers, which still hold the roster lock, make it odd 
+ * while they change the table and even again when they are done, and 
+ * readers copy what they need and start over if it moved in the meantime.
+ */
+static inline void roster_write_begin(CommCenterPrivate *ccp)
+{
+    atomic_inc(&ccp->roster_gen);
+}
+
+static inline void roster_write_end(CommCenterPrivate *ccp)
+{
+    atomic_inc(&ccp->roster_gen);
+}
+
+/* Returns the generation to read at, or -1 if a change has been going on
+ * for too long, in which case the writer may have died part way through.
+ */
+static qint64 roster_read_begin(CommCenterPrivate *ccp)
+{
+    qint64 gen;
+    int spins;
+
+    for(spins = 0; spins < ROSTER_READ_SPINS; spins++)
+    {
+        gen = atomic_load(&ccp->roster_gen);
+        if((gen & 1) == 0)
+            return gen;
+
+        QThread::yieldCurrentThread();
+    }
+
+    return -1;
+}
+
+static inline bool roster_read_retry(CommCenterPrivate *ccp, qint64 gen)
+{
+    return atomic_load(&ccp->roster_gen) != gen;
+}
+
+/* The peer table is changed under the roster lock, which lives in the 
+ * segment.  How often and for how long it is held is recorded in the
+ * statistics.  If its holder died part way through a change the table is
+ * put back in order before going on.
+ */
+void CommCenter::lockShared()
+{
+    CommCenterPrivate *ccp = (CommCenterPrivate *)sharedMemory.data();
+
+    if(shared_mutex_lock(&ccp->roster_lock) == SHARED_MUTEX_RECOVERED)
+    {
+        qDebug() << "Warning: Roster lock holder died, repairing the "
+            "peer table.";
+        repairRoster();
+    }
+    atomic_inc(&ccp->stats.st_lock_count);
+    lock_held.start();
+}
+
+void CommCenter::unlockShared()
+{
+    CommCenterPrivate *ccp = (CommCenterPrivate *)sharedMemory.data();
+    qint64 nsecs = lock_held.nsecsElapsed();
+
+    atomic_add(&ccp->stats.st_lock_nsecs, nsecs);
+    atomic_max(&ccp->stats.st_lock_max_nsecs, nsecs);
+    shared_mutex_unlock(&ccp->roster_lock);
+}
+
+/* Called with the roster lock held after taking it from a dead holder. An
+ * entry with a pid but no live bit was being added or removed when the 
+ * holder died, so it is released.  The free list and observer count are 
+ * then rebuilt from the entries themselves.
+ */
+void CommCenter::repairRoster()
+{
+    CommCenterPrivate *ccp;
+    struct PeerEntry *peer;
+    qint64 live;
+    int id;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+    if((atomic_load(&ccp->roster_gen) & 1) == 0)
+        roster_write_begin(ccp);
+
+    ccp->roster_free = -1;
+    ccp->nobservers = 0;
+
+    for(id = MSG_MAX_PEERS - 1; id >= 0; id--)
+    {
+        peer = &((ccp->peers)[id]);
+        live = atomic_load(&(ccp->roster_live)[PEER_WORD(id)]) & PEER_BIT(id);
+
+        if(peer->pe_pid != 0 && live != 0)
+        {
+            ccp->nobservers += 1;
+            continue;
+        }
+
+        if(peer->pe_pid != 0)
+        {
+            atomic_clear_bits(&(ccp->roster_armed)[PEER_WORD(id)], 
+                              PEER_BIT(id));
+            releaseUnread(id);
+            peer->pe_pid = 0;
+            peer->pe_lease = 0;
+            bzero(peer->pe_name, PEER_NAME_SIZE);
+        }
+
+        peer->pe_next_free = ccp->roster_free;
+        ccp->roster_free = id;
+    }
+
+    roster_write_end(ccp);
+}
+
+/* Takes an entry in the peer table for this process.  The entry's index 
+ * becomes our connection_id.
+ */
+bool CommCenter::joinRoster()
+{
+    CommCenterPrivate *ccp;
+    struct PeerEntry *peer;
+    QByteArray name_ba;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+    name_ba = peer_name.toUtf8();
+    lease_time = QDateTime::currentMSecsSinceEpoch();
+
+    lockShared();
+    connection_id = ccp->roster_free;
+    if(connection_id < 0)
+    {
+        unlockShared();
+        qDebug() << "Warning: Peer table is full.  "
+            "Messages may be missed.";
+        return false;
+    }
+
+    roster_write_begin(ccp);
+    peer = &((ccp->peers)[connection_id]);
+    ccp->roster_free = peer->pe_next_free;
+    ccp->nobservers += 1;
+
+    peer->pe_next_free = -1;
+    peer->pe_pid = QCoreApplication::applicationPid();
+    peer->pe_lease = lease_time;
+    peer->pe_received = 0;
+    bzero(peer->pe_name, PEER_NAME_SIZE);
+    memcpy(peer->pe_name, name_ba.constData(), 
+           qMin(name_ba.size(), PEER_NAME_SIZE - 1));
+
+    atomic_set_bits(&(ccp->roster_armed)[PEER_WORD(connection_id)],
+                    PEER_BIT(connection_id));
+    atomic_set_bits(&(ccp->roster_live)[PEER_WORD(connection_id)],
+                    PEER_BIT(connection_id));
+    roster_write_end(ccp);
+    unlockShared();
+
+    /* let everyone know there is someone new */
+    ringAll();
+
+    return true;
+}
+
+/* Removes connection id from the peer table, provided it still belongs to
+ * pid.  This is used both when disconnecting and to evict dead peers.
+ */
+void CommCenter::leaveRoster(int id, qint64 pid)
+{
+    CommCenterPrivate *ccp;
+    struct PeerEntry *peer;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+    peer = &((ccp->peers)[id]);
+
+    lockShared();
+    if(peer->pe_pid != pid)
+    {
+        unlockShared();
+        return;
+    }
+
+    roster_write_begin(ccp);
+    atomic_clear_bits(&(ccp->roster_live)[PEER_WORD(id)], PEER_BIT(id));
+    atomic_clear_bits(&(ccp->roster_armed)[PEER_WORD(id)], PEER_BIT(id));
+
+    /* nothing posted from here on expects the peer, so its unread 
+     * messages can be released before the ID goes back on the free list
+     */
+    releaseUnread(id);
+
+    peer->pe_pid = 0;
+    peer->pe_lease = 0;
+    bzero(peer->pe_name, PEER_NAME_SIZE);
+    peer->pe_next_free = ccp->roster_free;
+    ccp->roster_free = id;
+    ccp->nobservers -= 1;
+    roster_write_end(ccp);
+    unlockShared();
+
+    ringAll();
+}
+
+/* Called from the message pump.  Renews our lease, evicts peers whose 
+ * lease has run out and reports changes to the peer table.
+ */
+void CommCenter::maintainRoster()
+{
+    CommCenterPrivate *ccp;
+    qint64 now, pid;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+    now = QDateTime::currentMSecsSinceEpoch();
+
+    if((now - lease_time) >= PEER_LEASE_REFRESH)
+    {
+        pid = QCoreApplication::applicationPid();
+        lease_time = now;
+
+        if(connection_id >= 0 &&
+           atomic_load(&(ccp->peers)[connection_id].pe_pid) == pid)
+        {
+            atomic_store(&(ccp->peers)[connection_id].pe_lease, now);
+        }
+        else
+        {
+            /* we were evicted, e.g. after being stopped in a debugger */
+            joinRoster();
+        }
+
+        reapPeers(now);
+    }
+
+    if(atomic_load(&ccp->roster_gen) != roster_seen)
+        updatePeers();
+}
+
+void CommCenter::reapPeers(qint64 now)
+{
+    CommCenterPrivate *ccp;
+    struct PeerEntry *peer;
+    qint64 bits, age, pid;
+    int i, id;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+
+    for(i = 0; i < MSG_PEER_WORDS; i++)
+    {
+        bits = atomic_load(&(ccp->roster_live)[i]);
+        while(bits != 0)
+        {
+            id = (i << 6) + __builtin_ctzll(bits);
+            bits &= ~PEER_BIT(id);
+
+            if(id == connection_id)
+                continue;
+
+            peer = &((ccp->peers)[id]);
+            pid = atomic_load(&peer->pe_pid);
+            age = now - atomic_load(&peer->pe_lease);
+
+            if(pid == 0 || age < PEER_LEASE_EXPR)
+                continue;
+
+            if(age >= PEER_LEASE_LIMIT || !process_alive(pid))
+            {
+                qDebug() << "Evicting peer " << pid;
+                leaveRoster(id, pid);
+            }
+        }
+    }
+}
+
+/* Copies the connected peers, other than ourselves, out of the peer table
+ * and returns the generation of the table they were copied from.
+ */
+qint64 CommCenter::snapshotRoster(QHash<int, CommPeer> & roster)
+{
+    CommCenterPrivate *ccp;
+    struct PeerEntry *peer;
+    char name[PEER_NAME_SIZE];
+    qint64 bits, gen, pid, self;
+    CommPeer cp;
+    int i, id;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+    self = QCoreApplication::applicationPid();
+
+    for(;;)
+    {
+        gen = roster_read_begin(ccp);
+        if(gen < 0)
+        {
+            /* wait for the writer, or repair the table if it died */
+            lockShared();
+            unlockShared();
+            continue;
+        }
+
+        roster.clear();
+        for(i = 0; i < MSG_PEER_WORDS; i++)
+        {
+            bits = atomic_load(&(ccp->roster_live)[i]);
+            while(bits != 0)
+            {
+                id = (i << 6) + __builtin_ctzll(bits);
+                bits &= ~PEER_BIT(id);
+
+                peer = &((ccp->peers)[id]);
+                pid = atomic_load(&peer->pe_pid);
+                if(pid == 0 || pid == self)
+                    continue;
+
+                memcpy(name, peer->pe_name, PEER_NAME_SIZE);
+                name[PEER_NAME_SIZE - 1] = '\0';
+
+                cp.pid = pid;
+                cp.name = QString::fromUtf8(name);
+                roster.insert(id, cp);
+            }
+        }
+
+        if(!roster_read_retry(ccp, gen))
+            return gen;
+    }
+}
+
+/* Compares the peer table with what we saw last time and emits peerLeft()
+ * and peerJoined() for the differences.
+ */
+void CommCenter::updatePeers()
+{
+    QHash<int, CommPeer> roster;
+    QHash<int, CommPeer>::const_iterator i;
+
+    roster_seen = snapshotRoster(roster);
+
+    for(i = known_peers.constBegin(); i != known_peers.constEnd(); i++)
+    {
+        if(roster.value(i.key()).pid != i.value().pid)
+        {
+            dropDoorbell(i.value().pid);
+            emit peerLeft(i.value().pid, i.value().name);
+        }
+    }
+
+    for(i = roster.constBegin(); i != roster.constEnd(); i++)
+    {
+        if(known_peers.value(i.key()).pid != i.value().pid)
+            emit peerJoined(i.value().pid, i.value().name);
+    }
+
+    known_peers = roster;
+}
+
+/* Nothing has to be copied when the table has not changed since 
+ * known_peers was taken.  A fresh copy does not update known_peers, that
+ * is left to updatePeers() so no peerJoined() or peerLeft() is missed.
+ */
+QList<CommPeer> CommCenter::peers()
+{
+    CommCenterPrivate *ccp = (CommCenterPrivate *)sharedMemory.data();
+    QHash<int, CommPeer> roster;
+
+    if(roster_seen >= 0 && atomic_load(&ccp->roster_gen) == roster_seen)
+        return known_peers.values();
+
+    snapshotRoster(roster);
+    return roster.values();
+}
+
+/* A single aligned load, so it needs neither the lock nor a retry. */
+int CommCenter::observers()
+{
+    CommCenterPrivate *ccp = (CommCenterPrivate *)sharedMemory.data();
+
+    return (int)atomic_load(&ccp->nobservers);
+}
+
+int CommCenter::pending()
+{
+    return calls.size();
+}
+
+/* Outstanding calls can't be answered once we are no longer connected. */
+void CommCenter::finishCalls()
+{
+    QList<CommReply *> outstanding = calls.values();
+    int i;
+
+    for(i = 0; i < outstanding.size(); i++)
+    {
+        outstanding.at(i)->finish(false);
+    }
+}
+
+int CommCenter::queueDepth(Lane lane)
+{
+    CommCenterPrivate *ccp = (CommCenterPrivate *)sharedMemory.data();
+
+    if(ccp == NULL || lane < 0 || lane >= MSG_LANES)
+        return 0;
+
+    return (int)atomic_load(&(ccp->lanes)[lane].ring_depth);
+}
+
+QStringList CommCenter::allMessages()
+{
+    QStringList msgs;
+    int i, lane;
+
+    CommCenterPrivate *ccp = (CommCenterPrivate *)sharedMemory.data();
+    struct MsgLane *mlp;
+    struct MsgSlot *slotp;
+
+    QString builder;
+    for(lane = 0; lane < MSG_LANES; lane++)
+    {
+        mlp = &(ccp->lanes)[lane];
+        slotp = mlp->ring;
+
+        builder.sprintf("lane %d: head: %lld, depth: %lld"
+                        , lane, mlp->ring_head, mlp->ring_depth);
+        msgs << builder;
+
+        for(i = 0; i < MSG_MAX_COUNT; i++)
+        {
+            builder.sprintf("[%d] seq: %lld, time: %lld, expire: %lld, "
+                            "pending: %lld, from: %lld, to: %lld, id: %lld, "
+                            "reply to: %lld, size: %lld"
+                            , i, (slotp[i]).slot_seq
+                            , (mlp->ring_route)[i].route_time
+                            , (slotp[i]).slot_expire
+                            , PENDING_COUNT((slotp[i]).slot_pending)
+                            , (slotp[i]).slot_from
+                            , (slotp[i]).slot_to
+                            , (slotp[i]).slot_id
+                            , (mlp->ring_route)[i].route_reply_to
+                            , (slotp[i]).slot_size);
+            msgs << builder;
+        }
+    }
+
+    return msgs;
+}
+
+/* ---------- Doorbells ---------- */
+
+/* Wake up every peer that is waiting, used when the peer table changes. */
+void CommCenter::ringAll()
+{
+    CommCenterPrivate *ccp;
+    qint64 live[MSG_PEER_WORDS];
+    int i;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+
+    for(i = 0; i < MSG_PEER_WORDS; i++)
+    {
+        live[i] = atomic_load(&(ccp->roster_live)[i]);
+        if(connection_id >= 0 && PEER_WORD(connection_id) == i)
+            live[i] &= ~PEER_BIT(connection_id);
+    }
+
+    ringDoorbells(live);
+}
+
+/* Wake up the peers a message was posted for, as given by the message's
+ * msg_expect set.  Only peers which have armed their doorbell are rung.
+ */
+void CommCenter::ringDoorbells(const qint64 *expect)
+{
+    CommCenterPrivate *ccp;
+    qint64 bits, bit;
+    int i, id;
+
+    ccp = (CommCenterPrivate *)sharedMemory.data();
+
+    for(i = 0; i < MSG_PEER_WORDS; i++)
+    {
+        if(expect[i] == 0)
+            continue;
+
+        bits = expect[i] & atomic_load(&(ccp->roster_armed)[i]);
+        while(bits != 0)
+        {
+            id = (i << 6) + __builtin_ctzll(bits);
+            bit = PEER_BIT(id);
+            bits &= ~bit;
+
+            if((atomic_clear_bits(&(ccp->roster_armed)[i], bit) & bit) != 0)
+                ringDoorbell(atomic_load(&(ccp->peers)[id].pe_pid));
+        }
+    }
+}
+
+void CommCenter::ringDoorbell(qint64 pid)
+{
+    QLocalSocket *sock;
+
+    sock = doorbells.value(pid, NULL);
+    if(sock == NULL)
+    {
+        sock = new QLocalSocket(this);
+        doorbells.insert(pid, sock);
+    }
+
+    if(sock->state() == QLocalSocket::UnconnectedState)
+    {
+        sock->connectToServer(QString(DOORBELL_PREFIX) + QString::number(pid),
+                              QIODevice::WriteOnly);
+    }
+
+    sock->write("!", 1);
+    sock->flush();
+}
+
+/* Forgets the doorbell of a peer that has left or been evicted. */
+void CommCenter::dropDoorbell(qint64 pid)
+{
+    QLocalSocket *sock;
+
+    sock = doorbells.take(pid);
+    if(sock != NULL)
+    {
+        sock->abort();
+        sock->deleteLater();
+    }
+}
+
+/* ---------- Private Slots ---------- */
 
 void CommCenter::timerExpired()
 {
     qDebug() << "CommCenter timer expired";
 }
+
+void CommCenter::doorbellConnection()
+{
+    QLocalSocket *sock;
+
+    while((sock = doorbell->nextPendingConnection()) != NULL)
+    {
+        QObject::connect(sock, SIGNAL(readyRead()), 
+                         this, SLOT(doorbellRang()));
+        QObject::connect(sock, SIGNAL(disconnected()), 
+                         sock, SLOT(deleteLater()));
+    }
+}
+
+void CommCenter::doorbellRang()
+{
+    QLocalSocket *sock = qobject_cast<QLocalSocket *>(sender());
+    if(sock != NULL)
+        sock->readAll();
+
+    if(wakeup_pending)
+        return;
+
+    /* defer the signal so that a burst of doorbells results in a 
+     * single wakeup
+     */
+    wakeup_pending = true;
+    QMetaObject::invokeMethod(this, "notifyListeners", Qt::QueuedConnection);
+}
+
+void CommCenter::notifyListeners()
+{
+    wakeup_pending = false;
+    emit messagesPosted();
+}
+
+/* ---------- CommReply ---------- */
+
+CommReply::CommReply(CommCenter *cc, qint64 id, int expect, int timeout_ms)
+    : QObject(cc), center(cc), reply_id(id), reply_expect(expect),
+      reply_count(0), reply_timed_out(false)
+{
+    timer.setSingleShot(true);
+    QObject::connect(&timer, SIGNAL(timeout()), this, SLOT(timerExpired()));
+
+    /* with nobody to wait for there is no point in waiting */
+    timer.start(expect > 0 ? timeout_ms : 0);
+}
+
+CommReply::~CommReply()
+{
+    if(center != NULL)
+        center->calls.remove(reply_id);
+}
+
+qint64 CommReply::id() const
+{
+    return reply_id;
+}
+
+bool CommReply::isFinished() const
+{
+    return center == NULL;
+}
+
+bool CommReply::hasTimedOut() const
+{
+    return reply_timed_out;
+}
+
+QList<MessageView> CommReply::takeReplies()
+{
+    QList<MessageView> taken = replies;
+
+    replies.clear();
+    return taken;
+}
+
+void CommReply::deliver(const MessageView & view)
+{
+    replies.append(view);
+    if(!view->msg_more)
+        reply_count++;
+    emit replied();
+
+    if(center != NULL && reply_count >= reply_expect)
+        finish(false);
+}
+
+void CommReply::finish(bool timed_out)
+{
+    if(center == NULL)
+        return;
+
+    timer.stop();
+    center->calls.remove(reply_id);
+    center = NULL;
+    reply_timed_out = timed_out;
+
+    emit finished();
+}
+
+void CommReply::timerExpired()
+{
+    finish(reply_count < reply_expect);
+}
+
+/* ---------- MessageView ---------- */
+
+MessageView::MessageView()
+    : buf(NULL)
+{
+}
+
+MessageView::MessageView(struct MessageBuffer *b)
+    : buf(b)
+{
+}
+
+MessageView::MessageView(const MessageView & other)
+    : buf(other.buf)
+{
+    if(buf != NULL)
+        buffer_ref(buf);
+}
+
+MessageView::~MessageView()
+{
+    buffer_unref(buf);
+}
+
+MessageView & MessageView::operator=(const MessageView & other)
+{
+    if(other.buf != NULL)
+        buffer_ref(other.buf);
+
+    buffer_unref(buf);
+    buf = other.buf;
+
+    return *this;
+}
+
+bool MessageView::isNull() const
+{
+    return buf == NULL;
+}
+
+const struct Message *MessageView::message() const
+{
+    return buf != NULL ? &buf->mb_msg : NULL;
+}
+
+const struct Message *MessageView::operator->() const
+{
+    return message();
+}
+
+void MessageView::release()
+{
+    buffer_unref(buf);
+    buf = NULL;
+}
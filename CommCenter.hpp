@@ -42,18 +42,54 @@
 #include <QCoreApplication>
 #include <QDateTime>
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QLocalServer>
+#include <QLocalSocket>
 #include <QObject>
+#include <QPair>
 #include <QSharedMemory>
 #include <QStringList>
 #include <QString>
+#include <QTimer>
 
+#ifndef MSG_TIME_EXPR
 #define MSG_TIME_EXPR   60000       /* Duration (in miliseconds) a message 
                                      * will remain in the message box.
                                      */
-#define MSG_DATA_SIZE   512         /* Size (in bytes) of the data component of
-                                     * a message.
+#endif
+#define MSG_BLOCK_SIZE  256         /* Size (in bytes) of the blocks that
+                                     * message data is stored in.
                                      */
-#define MSG_MAX_COUNT   50          /* Number of entries in the message box.
+#define MSG_MAX_BLOCKS  4096        /* Number of blocks in the shared data
+                                     * arena.
+                                     */
+#define MSG_FRAG_SIZE   16384       /* Largest amount of data (in bytes) 
+                                     * carried by a single entry in the 
+                                     * message ring.  Larger messages are
+                                     * split into fragments and put back
+                                     * together by the reader.
+                                     */
+#define MSG_MAX_SIZE    (16 << 20)  /* Largest message (in bytes) a reader
+                                     * will put back together.
+                                     */
+#define MSG_MAX_COUNT   64          /* Number of entries in each lane's 
+                                     * message ring.
+                                     * This MUST be a power of two.
+                                     */
+#define MSG_LANES       2           /* Number of priority lanes, see 
+                                     * CommCenter::Lane.
+                                     */
+#define MSG_MAX_PEERS   256         /* Number of concurrent connections.
+                                     * This MUST be a multiple of 64.
+                                     */
+#define MSG_PEER_WORDS  (MSG_MAX_PEERS / 64)
+#define PEER_NAME_SIZE  64          /* Size (in bytes) of the name a 
+                                     * connection is listed under.
+                                     */
+#define CALL_TIMEOUT    10000       /* Default time (in milliseconds) call()
+                                     * waits for replies.
                                      */
 
 struct Message {
@@ -62,7 +98,13 @@ struct Message {
                                      * epoch as returned by 
                                      * QDateTime::currentMSecsSinceEpoch().
                                      */
-    qint64 msg_read;                /* Bit field where each bit is 
+    qint64 msg_expire;              /* Time after which readers drop the
+                                     * message, at most MSG_TIME_EXPR 
+                                     * after msg_time.
+                                     */
+    qint64 msg_lane;                /* Lane the message was sent in. */
+    qint64 msg_read[MSG_PEER_WORDS];
+                                    /* Bit field where each bit is 
                                      * mapped to a connection_id and 
                                      * represents whether or not that 
                                      * connection has read the message.
@@ -70,6 +112,16 @@ struct Message {
                                      * has not been read, 1 indicates that it
                                      * has.
                                      */
+    qint64 msg_expect[MSG_PEER_WORDS];
+                                    /* Bit field of the connections the
+                                     * message was addressed to when it 
+                                     * was posted.
+                                     */
+    qint64 msg_pending;             /* Number of connections in msg_expect
+                                     * which have not read the message yet.
+                                     * The message box is recycled when 
+                                     * this reaches 0.
+                                     */
     qint64 msg_from;                /* The process ID (from 
                                      * QCoreApplication::applicationPid())
                                      * of the sender.
@@ -80,45 +132,323 @@ struct Message {
                                      * indicates that the message is to be 
                                      * broadcast to all connections.
                                      */
-    char msg_data[MSG_DATA_SIZE];   /* The message to be sent.
+    qint64 msg_id;                  /* Correlation ID, unique among the 
+                                     * messages sent by msg_from.
+                                     */
+    qint64 msg_reply_to;            /* The msg_id of the request this 
+                                     * message answers, 0 if it is not a 
+                                     * reply.
                                      */
+    qint64 msg_more;                /* Non-zero if the sender has more
+                                     * replies to the same request to come.
+                                     */
+    qint64 msg_size;                /* Number of bytes in msg_data, not
+                                     * counting the terminating NUL.
+                                     */
+    char msg_data[1];               /* The message, always followed by a 
+                                     * NUL.  Received messages are 
+                                     * allocated to fit.
+                                     */
+};
+
+struct MessageBuffer;
+
+/* A reference to a received message.  Views are cheap to copy and the 
+ * message stays valid for as long as any view of it is around.  When the
+ * last one goes away the buffer is handed back to a per-process pool, so 
+ * once the pool has warmed up receiving a message allocates nothing.
+ */
+class MessageView
+{
+    friend class CommCenter;
+
+public:
+    MessageView();
+    MessageView(const MessageView & other);
+    ~MessageView();
+
+    MessageView & operator=(const MessageView & other);
+
+    bool isNull() const;
+    const struct Message *message() const;
+    const struct Message *operator->() const;
+
+    /* Drops this view's reference, leaving it null. */
+    void release();
+
+private:
+    explicit MessageView(struct MessageBuffer *buf);
+
+    struct MessageBuffer *buf;
+};
+
+struct CommPeer {
+    CommPeer() : pid(0) {}
+
+    qint64 pid;                     /* The process ID of the peer. */
+    QString name;                   /* The name given to connect(). */
+};
+
+class CommCenter;
+
+/* Handle for a request made with CommCenter::call().  Replies to the request
+ * are collected here until all of the peers it was sent to have answered or
+ * the timeout expires, at which point finished() is emitted and any further
+ * replies are dropped.  A peer that answers with a run of replies has only
+ * answered once the last of them, the one without msg_more, is in.  The 
+ * handle is a child of the CommCenter but should be deleted, with 
+ * deleteLater() if from one of its own signals, as soon as the caller is
+ * done with it.  Deleting it early cancels the call.
+ */
+class CommReply : public QObject
+{
+    Q_OBJECT
+
+    friend class CommCenter;
+
+public:
+    ~CommReply();
+
+    qint64 id() const;
+    bool isFinished() const;
+    bool hasTimedOut() const;
+
+    /* Removes and returns the replies received so far. */
+    QList<MessageView> takeReplies();
+
+signals:
+    /* Emitted from CommCenter::readMessages() as each reply arrives. */
+    void replied();
+    void finished();
+
+private slots:
+    void timerExpired();
+
+private:
+    CommReply(CommCenter *center, qint64 id, int expect, int timeout_ms);
+    void deliver(const MessageView & view);
+    void finish(bool timed_out);
+
+    CommCenter *center;             /* NULL once finished. */
+    qint64 reply_id;                /* msg_id of the request. */
+    int reply_expect;               /* Number of peers asked. */
+    int reply_count;
+    bool reply_timed_out;
+    QList<MessageView> replies;
+    QTimer timer;
 };
 
+/* A CommCenter is not thread safe.  It can be moved to another thread with
+ * moveToThread() before connect() is called, as long as it is only used 
+ * from that thread from then on.  Received messages can be handed to other
+ * threads, MessageView is safe to copy and release anywhere.
+ */
 class CommCenter : public QObject
 {
     Q_OBJECT
 
+    friend class CommReply;
+
 public:
+    enum PostStatus {
+        PostOk = 0,
+        PostTooLarge,               /* Larger than MSG_MAX_SIZE. */
+        PostRingFull,               /* No free entry in the message ring. */
+        PostArenaFull,              /* Not enough free blocks for the data. */
+        PostNotConnected            /* connect() has not succeeded. */
+    };
+
+    /* Messages are sent in one of two lanes, each with a ring of its own.
+     * Readers always take what is waiting in the interactive lane first.
+     */
+    enum Lane {
+        LaneInteractive = 0,        /* Requests a user is waiting on. */
+        LaneBulk                    /* Everything else. */
+    };
+
     CommCenter(QObject * parent = 0);
     ~CommCenter();
 
-    bool connect();
+    /* name is what other peers see this connection listed as. */
+    bool connect(const QString & name = QString());
     bool disconnect();
 
-    void broadcast(const QByteArray & msg);
-    void send(qint64 dst_pid, const QByteArray & msg);
+    /* broadcast() and send() return false if the message could 
+     * not be posted.
+     */
+    bool broadcast(const QByteArray & msg);
+    bool send(qint64 dst_pid, const QByteArray & msg);
+
+    /* As above but if there is no room for the message they wait up to
+     * wait_ms for readers to make some before giving up, and say why they
+     * did.  A message that hasn't been read lifetime_ms after it was sent 
+     * is dropped; 0 means MSG_TIME_EXPR, which is also the longest a 
+     * message can live.
+     */
+    PostStatus broadcastWait(const QByteArray & msg, int wait_ms, 
+                             int lifetime_ms = 0, 
+                             Lane lane = LaneInteractive);
+    PostStatus sendWait(qint64 dst_pid, const QByteArray & msg, int wait_ms,
+                        int lifetime_ms = 0, Lane lane = LaneInteractive);
+
+    static const char *statusString(PostStatus status);
+
+    /* Sends msg to dst_pid, or to everyone if dst_pid is 0, and returns a
+     * handle collecting the replies, or NULL if the message could not be
+     * posted.  The request is dropped by readers that don't get to it 
+     * before timeout_ms is up.  If no connected peer was addressed the 
+     * handle finishes, without timing out, as soon as the event loop gets
+     * to it.
+     */
+    CommReply *call(qint64 dst_pid, const QByteArray & msg,
+                    int timeout_ms = CALL_TIMEOUT, 
+                    Lane lane = LaneInteractive);
+
+    /* Answers a request received from another peer.  The reply is sent
+     * in the request's lane and lives no longer than the request did.  A
+     * long answer can be streamed as several replies, all but the last
+     * sent with more set.
+     */
+    bool reply(const struct Message *request, const QByteArray & msg,
+               bool more = false);
+
+    /* Returns the next message waiting for this connection, or a null 
+     * view if there is none.
+     */
+    MessageView readView();
+
+    /* Appends every message currently waiting for this connection, up
+     * to max_msgs if it is not negative, to msgs and returns the number
+     * appended.
+     */
+    int readMessages(QList<MessageView> & msgs, int max_msgs = -1);
 
-    /* NOTE: The pointer returned by readMessage()
-     * NOTE: MUST be released by the caller.
+    /* As above but each message is copied into memory of its own.
+     * NOTE: The pointers returned MUST be released by the caller.
      */
-    struct Message *readMessage(int msg_box);
+    struct Message *readMessage();
+    int readMessages(QList<struct Message *> & msgs, int max_msgs = -1);
+
+    /* Returns every other peer currently connected. */
+    QList<CommPeer> peers();
 
     int observers();
+
+    /* Returns the number of calls still waiting for replies. */
     int pending();
+
+    /* Returns the number of messages in lane which have been posted but 
+     * not yet read by everyone they were sent to, or expired.
+     */
+    int queueDepth(Lane lane);
     QStringList allMessages();
     bool isConnected();
 
+signals:
+    /* Emitted when a message that may be addressed to this connection
+     * has been posted.  Several posts in quick succession are coalesced
+     * into a single signal, so receivers should read until readView()
+     * returns a null view.
+     */
+    void messagesPosted();
+
+    /* Emitted from readMessages() when another peer shows up in or 
+     * disappears from the peer table.  Peers which die without
+     * disconnecting are removed once their lease runs out.
+     */
+    void peerJoined(qint64 pid, const QString & name);
+    void peerLeft(qint64 pid, const QString & name);
+
 private slots:
     void timerExpired();
+    void doorbellConnection();
+    void doorbellRang();
+    void notifyListeners();
 
 private:
-    int nextMsgBox(void *vccp);
-    void postMessage(qint64 dst_pid, const QByteArray & msg_ba);
+    MessageView readLane(int lane);
+    PostStatus postMessage(int lane, qint64 dst_pid, const QByteArray & msg_ba,
+                           qint64 msg_id, qint64 reply_to, bool more,
+                           qint64 expire, int wait_ms, qint64 *expect);
+    PostStatus postFragment(int lane, qint64 dst_pid, const char *data, 
+                            qint64 size, qint64 offset, qint64 total,
+                            qint64 msg_id, qint64 reply_to, bool more,
+                            qint64 expire, qint64 wait_until, 
+                            qint64 *expect);
+    qint64 allocBlocks(int lane, int count);
+    void reclaimExpired();
+    struct MessageBuffer *reassemble(struct MessageBuffer *frag, 
+                                     qint64 offset, qint64 total);
+    void purgeFragments(qint64 now);
+    void finishCalls();
+    int expectedReaders(qint64 dst_pid, qint64 *expect);
+    int peerIndex(qint64 pid);
+    void lockShared();
+    void unlockShared();
+    void repairRoster();
+    bool joinRoster();
+    void leaveRoster(int id, qint64 pid);
+    void maintainRoster();
+    void reapPeers(qint64 now);
+    qint64 snapshotRoster(QHash<int, CommPeer> & roster);
+    void updatePeers();
+    void releaseUnread(int id);
+    void ringAll();
+    void ringDoorbells(const qint64 *expect);
+    void ringDoorbell(qint64 pid);
+    void dropDoorbell(qint64 pid);
 
     bool connected;
-    qint64 connection_id;
+    qint64 connection_id;           /* Index of our entry in the shared 
+                                     * peer table and of our bit in 
+                                     * msg_read, -1 if not connected.
+                                     */
+
+    qint64 read_pos[MSG_LANES];     /* Next position in each lane's ring 
+                                     * this connection will look at in 
+                                     * readMessage().
+                                     */
+    qint64 stall_pos[MSG_LANES];    /* Ring position readMessage() found
+                                     * claimed but not yet published, and
+                                     * the time it was first seen that way.
+                                     */
+    qint64 stall_since[MSG_LANES];
+
+    QString peer_name;              /* Name given to connect(). */
+    qint64 lease_time;              /* Last time our lease was renewed. */
+    qint64 roster_seen;             /* Roster generation known_peers was
+                                     * taken from, -1 if never.
+                                     */
+    QHash<int, CommPeer> known_peers;
+
+    QLocalServer *doorbell;         /* Peers write a byte to our doorbell 
+                                     * after posting a message for us.
+                                     */
+    QHash<qint64, QLocalSocket *> doorbells;
+    QHash<qint64, int> peer_ids;    /* Cache of process ID to peer table
+                                     * index, checked against the table 
+                                     * before use.
+                                     */
+    bool wakeup_pending;
+
+    struct Partial {
+        Partial() : buf(NULL), received(0), started(0) {}
+
+        struct MessageBuffer *buf;
+        qint64 received;            /* Bytes filled in so far. */
+        qint64 started;             /* Time the first fragment arrived. */
+    };
+    QHash<QPair<qint64, qint64>, Partial> fragments;
+                                    /* Messages being put back together,
+                                     * by msg_from and msg_id.
+                                     */
+
+    qint64 next_id;                 /* msg_id of the next message sent. */
+    QHash<qint64, CommReply *> calls;
+                                    /* Outstanding calls by msg_id. */
 
     QSharedMemory sharedMemory;
+    QElapsedTimer lock_held;        /* Time since lockShared(). */
 };
 
 #endif /* __COMM_CENTER_HPP__ */
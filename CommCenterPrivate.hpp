@@ -0,0 +1,266 @@
+/*
+ * Plugin: Rails
+ * Author: Dean Pucsek <dean@lightbulbone.com>
+ * Date: 17 October 2026
+ *
+ * Layout of the shared memory segment used by CommCenter.  Only CommCenter
+ * and tools that inspect a running session, such as railsstat, should need
+ * this.
+ *
+ *
+ * Copyright (c) 2012, Dean Pucsek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the LightBulbOne nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __COMM_CENTER_PRIVATE_HPP__
+#define __COMM_CENTER_PRIVATE_HPP__
+
+#include "CommCenter.hpp"
+#include "SharedMutex.hpp"
+
+#define SHM_RAILS_KEY    "rails"
+#define SHM_RAILS_SIZE   (sizeof(struct CommCenterPrivate))
+
+#define MSG_RING_MASK    (MSG_MAX_COUNT - 1)
+
+/* Messages are stored in a ring shared by all connections.  Producers claim
+ * a position by advancing ring_head and every slot carries a sequence
+ * number which says what state it is in relative to a ring position pos:
+ *
+ *   slot_seq == pos                    free, may be claimed for pos
+ *   slot_seq == pos + 1                message for pos has been published
+ *   slot_seq == pos + MSG_MAX_COUNT    retired, free for the next lap
+ *
+ * A published message is retired by the reader that completes its 
+ * expected set, or by a producer once it has expired.  A position whose 
+ * producer died between claiming and publishing it is retired by whoever
+ * next finds it stuck, see the claim fields of struct MsgRoute.  All 
+ * updates to ring_head and slot_seq are done with compare-and-swap so 
+ * neither posting nor reading requires the sharedMemory lock.
+ *
+ * Each ring entry is split in two.  The slot holds what readers and 
+ * producers look at for every position, packed into a single cache line,
+ * while the route, kept in a table of its own, holds what is only needed
+ * once a message is actually being read.  The data itself lives in the
+ * arena, so scanning the ring never touches it.
+ *
+ * There is a ring for each lane.  Readers always empty the interactive 
+ * lane before looking at the bulk lane, so a burst of bulk traffic can't
+ * hold up a request the user is waiting on.
+ */
+#define CACHE_LINE_SIZE  64
+
+struct MsgSlot
+{
+    qint64 slot_seq;
+    qint64 slot_expire;             /* See the matching fields of struct */
+    qint64 slot_from;               /* Message.                          */
+    qint64 slot_to;
+    qint64 slot_id;
+    qint64 slot_pending;            /* See PENDING_WORD() below. */
+    qint64 slot_size;
+    qint64 slot_block;              /* First arena block holding the data,
+                                     * -1 if there is none.
+                                     */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* slot_pending holds the number of readers yet to read the message in its
+ * low PENDING_BITS bits and the low bits of the sequence number it was
+ * published at above them.  A reader counts down with a compare-and-swap
+ * on the whole word, so one that is late can't count down the message of 
+ * a later lap however many readers that message is waiting for.
+ */
+#define PENDING_BITS     16
+#define PENDING_MASK     ((1LL << PENDING_BITS) - 1)
+#define PENDING_WORD(seq, count) \
+    ((qint64)((quint64)(seq) << PENDING_BITS) | (count))
+#define PENDING_COUNT(word) ((word) & PENDING_MASK)
+
+struct MsgRoute
+{
+    qint64 route_time;
+    qint64 route_op;                /* First byte of the message, -1 for
+                                     * fragments after the first.
+                                     */
+    qint64 route_reply_to;
+    qint64 route_more;              /* Set on all but the last of a run of
+                                     * replies.
+                                     */
+    qint64 route_offset;            /* Offset of the data within the whole
+                                     * message and the size of the whole
+                                     * message, for fragments.
+                                     */
+    qint64 route_total;
+    qint64 route_claim_pos;         /* Position the slot was last claimed 
+                                     * for, stored once the claimer has 
+                                     * filled in slot_size, slot_block and
+                                     * the two fields below.  -1 until the
+                                     * first claim.
+                                     */
+    qint64 route_claim_pid;         /* Process that claimed it. */
+    qint64 route_claim_time;        /* When it was claimed. */
+    qint64 route_expect[MSG_PEER_WORDS];
+    qint64 route_read[MSG_PEER_WORDS];
+};
+
+struct MsgLane
+{
+    qint64 ring_head;               /* Next ring position to be claimed. */
+    qint64 ring_depth;              /* Messages published and not yet
+                                     * retired.
+                                     */
+    struct MsgSlot ring[MSG_MAX_COUNT];
+    struct MsgRoute ring_route[MSG_MAX_COUNT];
+};
+
+/* Message data is kept apart from the ring in an arena of fixed size 
+ * blocks.  A message's blocks are chained through arena_next and handed
+ * back by whoever retires its slot.  Free blocks are kept on a stack whose
+ * top, arena_free, holds the block index in the low 32 bits and a tag in 
+ * the high 32 bits that is bumped on every change so that a stale 
+ * compare-and-swap can't succeed.
+ *
+ * The bulk lane is not allowed to take the last MSG_BULK_RESERVE blocks so
+ * that interactive messages can still be posted when it is busy.
+ */
+#define MSG_BULK_RESERVE (MSG_MAX_BLOCKS / 8)
+
+#define ARENA_NONE      ((qint64)0xffffffff)
+#define ARENA_TOP(tag, idx) \
+    ((qint64)(((((quint64)(tag) >> 32) + 1) << 32) | (quint64)(idx)))
+
+#define BLOCK_COUNT(size) \
+    ((int)(((size) + MSG_BLOCK_SIZE - 1) / MSG_BLOCK_SIZE))
+
+/* Connected peers are kept in a fixed size table.  A connection's index in
+ * the table is its connection_id and the bit it owns in every peer bit
+ * field.  Unused entries are linked into a free list so that IDs are handed
+ * out again as soon as a peer leaves.
+ */
+struct PeerEntry
+{
+    qint64 pe_pid;                  /* Process ID, 0 if the entry is unused */
+    qint64 pe_next_free;            /* Next unused entry, or -1 */
+    qint64 pe_lease;                /* Last time the peer renewed its lease,
+                                     * as returned by 
+                                     * QDateTime::currentMSecsSinceEpoch().
+                                     */
+    char pe_name[PEER_NAME_SIZE];   /* Name given to connect(). */
+    qint64 pe_received;             /* Messages the peer has received. */
+};
+
+/* Statistics are kept in the segment as well.  They are only ever updated
+ * with atomic adds, so they can be sampled by railsstat without the lock 
+ * and without getting in the way of a live session.  A message counts 
+ * once however many fragments it was sent in; counts by operation use the
+ * first byte of the message, which is its operation in the Rails protocol.
+ */
+#define STAT_OPS        256
+
+struct OpStats
+{
+    qint64 os_posted;               /* Messages posted. */
+    qint64 os_delivered;            /* Messages received, once per reader. */
+    qint64 os_dropped;              /* Messages that could not be posted. */
+    qint64 os_expired;              /* Messages that expired before they 
+                                     * were read, once per reader.
+                                     */
+};
+
+struct LaneStats
+{
+    struct OpStats ls_totals;
+    qint64 ls_depth_peak;           /* Most messages ever in the ring. */
+};
+
+struct CommStats
+{
+    struct LaneStats st_lanes[MSG_LANES];
+    struct OpStats st_ops[STAT_OPS];
+    qint64 st_head_retries;         /* Compare-and-swaps on ring_head lost
+                                     * to another producer.
+                                     */
+    qint64 st_busy_spins;           /* Yields waiting for a producer to 
+                                     * publish the previous lap.
+                                     */
+    qint64 st_room_waits;           /* Sleeps waiting for room in the ring
+                                     * or the arena.
+                                     */
+    qint64 st_stale_claims;         /* Positions retired unpublished after 
+                                     * their producer died or stalled.
+                                     */
+    qint64 st_arena_low;            /* Fewest free arena blocks seen. */
+    qint64 st_lock_count;           /* Times the roster lock was taken, 
+                                     * and how long it was held (in 
+                                     * nanoseconds) in total and at most.
+                                     */
+    qint64 st_lock_nsecs;
+    qint64 st_lock_max_nsecs;
+};
+
+/* The segment is laid out by whoever creates it, or by the first to attach
+ * if the creator died before it was done, under the sharedMemory lock.  
+ * init_done is set to SHM_RAILS_READY last, so anyone who sees it set can
+ * use the segment without taking the lock.
+ */
+#define SHM_RAILS_READY  ((qint64)0x5261696c73524459LL)
+
+struct CommCenterPrivate 
+{
+    qint64 init_done;
+    struct SharedMutex roster_lock; /* Held while the peer table changes. */
+    qint64 nobservers;
+    qint64 roster_gen;              /* Bumped when a change to the peer
+                                     * table starts and again when it is
+                                     * done, so it is odd while one is in 
+                                     * progress.
+                                     */
+    qint64 roster_free;             /* First unused peer entry, or -1 */
+    qint64 roster_live[MSG_PEER_WORDS];
+                                    /* Bit set for each connected peer. */
+    qint64 roster_armed[MSG_PEER_WORDS];
+                                    /* Bit set for each peer that ran out of
+                                     * messages and is waiting for its 
+                                     * doorbell.  The first poster to clear
+                                     * a peer's bit rings its doorbell, so a
+                                     * burst of messages costs one wakeup.
+                                     */
+    struct PeerEntry peers[MSG_MAX_PEERS];
+    struct MsgLane lanes[MSG_LANES];
+    qint64 arena_free;              /* Top of the free block stack. */
+    qint64 arena_avail;             /* Number of free blocks. */
+    qint64 arena_next[MSG_MAX_BLOCKS];
+    struct CommStats stats;
+    char arena[MSG_MAX_BLOCKS][MSG_BLOCK_SIZE];
+};
+
+#define PEER_WORD(id)   ((id) >> 6)
+#define PEER_BIT(id)    ((qint64)((quint64)1 << ((id) & 63)))
+
+#endif /* __COMM_CENTER_PRIVATE_HPP__ */
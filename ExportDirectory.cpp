@@ -0,0 +1,372 @@
+/*
+ * Plugin: Rails
+ * Author: Dean Pucsek <dean@lightbulbone.com>
+ * Date: 17 October 2026
+ *
+ * A per-instance directory of exported symbols kept in shared memory so
+ * that requests can be routed to the instances that can answer them.
+ *
+ *
+ * Copyright (c) 2012, Dean Pucsek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the LightBulbOne nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "ExportDirectory.hpp"
+
+#include <QDebug>
+#include <QPair>
+#include <QString>
+#include <QThread>
+#include <QtAlgorithms>
+
+#include <string.h>
+
+#define EXPORTS_PREFIX  "rails-exports-"
+#define EXPORTS_MAGIC   0x52455832      /* 'REX2' */
+#define EXPORTS_TRIES   100             /* Times a reader tries to get a 
+                                         * consistent view before giving
+                                         * up.
+                                         */
+
+#define FNV_OFFSET      2166136261u
+#define FNV_PRIME       16777619u
+
+ExportDirectory::ExportDirectory()
+{
+    exports = NULL;
+}
+
+ExportDirectory::~ExportDirectory()
+{
+    QHash<qint64, QSharedMemory *>::iterator i;
+
+    withdraw();
+
+    for(i = segments.begin(); i != segments.end(); i++)
+    {
+        delete i.value();
+    }
+    segments.clear();
+}
+
+/* Only the owner writes its directory, so eh_seq needs no more than full
+ * barriers around the write.
+ */
+static inline quint32 seq_load(const struct ExportHeader *eh)
+{
+    quint32 seq = *(volatile const quint32 *)&eh->eh_seq;
+
+    __sync_synchronize();
+    return seq;
+}
+
+static inline void seq_bump(struct ExportHeader *eh)
+{
+    __sync_fetch_and_add(&eh->eh_seq, 1);
+}
+
+quint32 ExportDirectory::hash(const QByteArray & name)
+{
+    quint32 h = FNV_OFFSET;
+    int i;
+
+    for(i = 0; i < name.size(); i++)
+    {
+        h ^= (unsigned char)name.at(i);
+        h *= FNV_PRIME;
+    }
+
+    return h;
+}
+
+/* Make sure we own a segment of at least size bytes.  The segment is created
+ * with some room to spare so that a handful of new names doesn't force it to
+ * be recreated.  A segment left behind by an earlier process with the same 
+ * ID is reused if it is big enough and replaced otherwise.
+ */
+bool ExportDirectory::reserve(qint64 pid, int size)
+{
+    int want = size + size / 2;
+
+    if(exports != NULL && exports->size() >= size)
+        return true;
+
+    withdraw();
+    exports = new QSharedMemory(QString(EXPORTS_PREFIX) 
+                                + QString::number(pid));
+
+    if(exports->create(want))
+        return true;
+
+    if(exports->error() == QSharedMemory::AlreadyExists && exports->attach())
+    {
+        if(exports->size() >= size)
+            return true;
+
+        /* too small, the segment goes away once no one else has it */
+        exports->detach();
+        if(exports->create(want))
+            return true;
+    }
+
+    qDebug() << "Unable to publish exports:" << exports->errorString();
+    delete exports;
+    exports = NULL;
+    return false;
+}
+
+bool ExportDirectory::publish(qint64 pid, const QList<QByteArray> & names)
+{
+    QList<QPair<quint32, int> > order;
+    struct ExportHeader *eh;
+    struct ExportEntry *ee;
+    char *pool;
+    int i, size, pool_size;
+
+    pool_size = 0;
+    order.reserve(names.size());
+    for(i = 0; i < names.size(); i++)
+    {
+        order.append(qMakePair(hash(names.at(i)), i));
+        pool_size += names.at(i).size() + 1;
+    }
+    qSort(order);
+
+    size = sizeof(struct ExportHeader) 
+        + names.size() * sizeof(struct ExportEntry)
+        + pool_size;
+
+    if(!reserve(pid, size))
+        return false;
+
+    eh = (struct ExportHeader *)exports->data();
+    seq_bump(eh);
+
+    ee = (struct ExportEntry *)(eh + 1);
+    pool = (char *)(ee + names.size());
+
+    pool_size = 0;
+    for(i = 0; i < order.size(); i++)
+    {
+        const QByteArray & name = names.at(order.at(i).second);
+
+        ee[i].ee_hash = order.at(i).first;
+        ee[i].ee_name = pool_size;
+        memcpy(pool + pool_size, name.constData(), name.size() + 1);
+        pool_size += name.size() + 1;
+    }
+
+    eh->eh_magic = EXPORTS_MAGIC;
+    eh->eh_count = names.size();
+    eh->eh_pool = pool_size;
+    eh->eh_owner = pid;
+
+    seq_bump(eh);
+
+    return true;
+}
+
+/* Tell readers attached to our segment that it is no longer used. */
+void ExportDirectory::retire()
+{
+    struct ExportHeader *eh;
+
+    eh = (struct ExportHeader *)exports->data();
+    if(eh == NULL)
+        return;
+
+    seq_bump(eh);
+    eh->eh_magic = 0;
+    seq_bump(eh);
+}
+
+void ExportDirectory::withdraw()
+{
+    if(exports != NULL)
+    {
+        retire();
+        exports->detach();
+        delete exports;
+        exports = NULL;
+    }
+}
+
+/* Returns the directory segment of pid, attaching to it if we haven't 
+ * already, or NULL if there is none.
+ */
+QSharedMemory *ExportDirectory::segment(qint64 pid)
+{
+    QHash<qint64, QSharedMemory *>::const_iterator i;
+    QSharedMemory *seg;
+
+    i = segments.constFind(pid);
+    if(i != segments.constEnd())
+        return i.value();
+
+    seg = new QSharedMemory(QString(EXPORTS_PREFIX) + QString::number(pid));
+    if(!seg->attach(QSharedMemory::ReadOnly))
+    {
+        delete seg;
+        return NULL;
+    }
+
+    segments.insert(pid, seg);
+    return seg;
+}
+
+void ExportDirectory::forget(qint64 pid)
+{
+    delete segments.take(pid);
+}
+
+void ExportDirectory::expire()
+{
+    QHash<qint64, QSharedMemory *>::iterator i;
+    const struct ExportHeader *eh;
+
+    for(i = segments.begin(); i != segments.end(); )
+    {
+        eh = (const struct ExportHeader *)i.value()->constData();
+        if(eh->eh_magic == 0 && (seq_load(eh) & 1) == 0)
+        {
+            delete i.value();
+            i = segments.erase(i);
+        }
+        else
+            i++;
+    }
+}
+
+/* Returns 1 if the instance identified by pid exports name, 0 if it does not
+ * and -1 if it has not published a directory that we can read.  Everything
+ * read from the segment may be changing under us until eh_seq says 
+ * otherwise, so it is read once and checked before it is used.
+ */
+int ExportDirectory::lookup(qint64 pid, const QByteArray & name)
+{
+    const struct ExportHeader *eh;
+    const struct ExportEntry *ee;
+    QSharedMemory *seg;
+    const char *pool;
+    quint32 h, lo, hi, mid, off, count, pool_size, seq;
+    quint32 magic;
+    qint64 owner;
+    int found, tries;
+
+    seg = segment(pid);
+    if(seg == NULL)
+        return -1;
+
+    eh = (const struct ExportHeader *)seg->constData();
+    h = hash(name);
+
+    for(tries = 0; tries < EXPORTS_TRIES; tries++)
+    {
+        seq = seq_load(eh);
+        if((seq & 1) != 0)
+        {
+            QThread::yieldCurrentThread();
+            continue;
+        }
+
+        magic = eh->eh_magic;
+        owner = eh->eh_owner;
+        count = eh->eh_count;
+        pool_size = eh->eh_pool;
+
+        found = -1;
+        if(magic == EXPORTS_MAGIC && owner == pid
+           && (quint64)sizeof(struct ExportHeader) 
+              + (quint64)count * sizeof(struct ExportEntry) 
+              + pool_size <= (quint64)seg->size())
+        {
+            ee = (const struct ExportEntry *)(eh + 1);
+            pool = (const char *)(ee + count);
+            found = 0;
+
+            /* find the first entry with a matching hash */
+            lo = 0;
+            hi = count;
+            while(lo < hi)
+            {
+                mid = lo + (hi - lo) / 2;
+                if(ee[mid].ee_hash < h)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+
+            for(; lo < count && ee[lo].ee_hash == h; lo++)
+            {
+                off = ee[lo].ee_name;
+                if(off < pool_size && (quint32)name.size() < pool_size - off
+                   && memcmp(pool + off, name.constData(), name.size()) == 0
+                   && pool[off + name.size()] == '\0')
+                {
+                    found = 1;
+                    break;
+                }
+            }
+        }
+
+        if(seq_load(eh) != seq)
+            continue;
+
+        /* the owner has moved to a new segment, or never published */
+        if(magic != EXPORTS_MAGIC)
+            forget(pid);
+
+        return found;
+    }
+
+    return -1;
+}
+
+/* Of the instances in pids return those which export name.  Instances whose
+ * directory could not be read are added to unknown, if given, so that the
+ * caller can fall back to asking everyone.
+ */
+QList<qint64> ExportDirectory::owners(const QList<qint64> & pids,
+                                      const QByteArray & name,
+                                      QList<qint64> *unknown)
+{
+    QList<qint64> found;
+    int i, rc;
+
+    for(i = 0; i < pids.size(); i++)
+    {
+        rc = lookup(pids.at(i), name);
+        if(rc > 0)
+            found.append(pids.at(i));
+        else if(rc < 0 && unknown != NULL)
+            unknown->append(pids.at(i));
+    }
+
+    return found;
+}
@@ -0,0 +1,112 @@
+/*
+ * Plugin: Rails
+ * Author: Dean Pucsek <dean@lightbulbone.com>
+ * Date: 17 October 2026
+ *
+ * A per-instance directory of exported symbols kept in shared memory so
+ * that requests can be routed to the instances that can answer them.
+ *
+ *
+ * Copyright (c) 2012, Dean Pucsek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the LightBulbOne nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __EXPORT_DIRECTORY_HPP__
+#define __EXPORT_DIRECTORY_HPP__
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QSharedMemory>
+
+/* Each instance publishes the names it is able to resolve into a segment of
+ * its own, keyed on its process ID.  The segment holds a small header, the
+ * FNV-1a hash of every name sorted in ascending order and a pool of the
+ * names themselves:
+ *
+ *    +--------------+-------------------------+---------------------+
+ *    | ExportHeader | ExportEntry[eh_count]   | name pool           |
+ *    +--------------+-------------------------+---------------------+
+ *
+ * A lookup is then a binary search on the hash followed by a comparison 
+ * against the pooled name to rule out collisions.
+ *
+ * Readers keep the segments they have looked at attached and never take
+ * the segment's lock.  eh_seq works as a sequence lock instead: the owner
+ * makes it odd while it rewrites the directory and even again when it is
+ * done, and a reader that sees it odd, or changed by the time it is done,
+ * tries again.  An owner that needs a bigger segment clears eh_magic in 
+ * the old one before letting it go, which tells readers to attach again.
+ */
+struct ExportHeader {
+    quint32 eh_magic;
+    quint32 eh_count;       /* number of entries */
+    quint32 eh_pool;        /* bytes used in the name pool */
+    quint32 eh_seq;         /* odd while the directory is being written */
+    qint64  eh_owner;       /* pid of the publishing instance */
+};
+
+struct ExportEntry {
+    quint32 ee_hash;
+    quint32 ee_name;        /* offset of the name in the pool */
+};
+
+class ExportDirectory
+{
+public:
+    ExportDirectory();
+    ~ExportDirectory();
+
+    bool publish(qint64 pid, const QList<QByteArray> & names);
+    void withdraw();
+    QList<qint64> owners(const QList<qint64> & pids, 
+                         const QByteArray & name,
+                         QList<qint64> *unknown = NULL);
+
+    /* Detaches from the directory of pid, which has gone away. */
+    void forget(qint64 pid);
+
+    /* Detaches from directories their owners have given up, so that the
+     * owners can replace them.  Should be called every now and then.
+     */
+    void expire();
+
+    static quint32 hash(const QByteArray & name);
+
+private:
+    bool reserve(qint64 pid, int size);
+    void retire();
+    QSharedMemory *segment(qint64 pid);
+    int lookup(qint64 pid, const QByteArray & name);
+
+    QSharedMemory *exports;
+    QHash<qint64, QSharedMemory *> segments;
+};
+
+#endif
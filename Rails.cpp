@@ -45,12 +45,32 @@
 #include <kernwin.hpp>
 #include <nalt.hpp>
 #include <entry.hpp>
+#include <funcs.hpp>
+#include <bytes.hpp>
+#include <name.hpp>
 
 /* Rails includes */
 #include "CommCenter.hpp"
+#include "ExportDirectory.hpp"
+#include "RailsProtocol.hpp"
 #include "RailsResponder.hpp"
+#include "RailsWorker.hpp"
+
+#include <QByteArray>
+#include <QHash>
+#include <QMap>
+#include <QMutex>
+#include <QPair>
+#include <QSet>
+#include <QStringList>
+#include <QThread>
+
+#include <stddef.h>
 
 /* Qt includes */
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QTimer>
 #include <QTextBrowser>
 #include <QSplitter>
 #include <QListWidget>
@@ -59,476 +79,1907 @@
 
 /* -------------- Communication Protocol -------------- */
 
-/* There are three categories of messages available in Rails.
- * - rails : This category of messages pertain to global-scope
- *           messages such as get an IDA databases to process IDs
+/* There are two categories of messages available in Rails.
  * - cmt   : This category of messages deals with requesting and
  *           and receiving comments from external databases.
  * - nav   : This category is for navigation to, and within, external 
  *           databases.
+ *
+ * Knowing which instances are around does not need any messages, the
+ * CommCenter peer table tells us when an instance joins or leaves (see
+ * rails_peer_joined() and rails_peer_left()).
+ *
+ * The messages themselves and how they are encoded are described in
+ * RailsProtocol.hpp.
+ */
+
+/* -------------- Globals -------------- */
+
+/* The CommCenter lives on gWorkerThread, where gWorker reads, decodes and
+ * sends messages so that none of it holds up IDA's UI.  Only what touches
+ * the database or the widgets is handed back to the UI thread, in batches
+ * (see gBatch), and the UI thread never calls the CommCenter itself but 
+ * queues what it wants sent (see gOutbox).
+ *
+ * gCommCenter is global so that it can be disconnected, on its own thread,
+ * when the plugin is terminated.  Without doing this the shared memory 
+ * region used is not deleted upon disconnecting all clients.  It must ONLY
+ * be used from the worker thread.
+ */
+CommCenter *gCommCenter = NULL;
+QThread *gWorkerThread;
+RailsWorker *gWorker;
+
+/* Work handed from the worker to the UI thread.  It collects in gBatch 
+ * until the UI thread takes it, and only the first addition after that
+ * posts an event to the responder, so a burst of messages costs the UI 
+ * thread a single wakeup.
+ */
+struct RailsPeerEvent {
+    qint64 pv_pid;
+    QString pv_name;
+    bool pv_joined;
+};
+
+struct RailsBatch {
+    QList<MessageView> rb_msgs;     /* Messages for the UI handlers. */
+    QStringList rb_console;         /* Lines for the console. */
+    QList<struct RailsPeerEvent> rb_peers;
+};
+
+QMutex gBatchLock;
+struct RailsBatch gBatch;
+bool gBatchPosted;
+
+/* Messages the UI thread wants sent, in the order they were queued. The
+ * worker is woken up in the same way as the UI thread is for gBatch.
+ */
+#define RAILS_OUT_SEND  0
+#define RAILS_OUT_CALL  1   /* The worker handles the replies. */
+#define RAILS_OUT_REPLY 2
+
+struct RailsOutgoing {
+    RailsOutgoing() : ro_kind(RAILS_OUT_SEND), ro_pid(0), ro_more(false),
+                      ro_lane(CommCenter::LaneInteractive)
+    {
+        bzero(&ro_request, sizeof(ro_request));
+    }
+
+    int ro_kind;
+    qint64 ro_pid;                  /* Destination, 0 for everyone. */
+    QByteArray ro_msg;
+    struct Message ro_request;      /* Header of the request a reply 
+                                     * answers.
+                                     */
+    bool ro_more;                   /* Set on a reply if more replies to
+                                     * the same request follow.
+                                     */
+    CommCenter::Lane ro_lane;       /* Not used for replies, they go in 
+                                     * the request's lane.
+                                     */
+};
+
+QMutex gOutboxLock;
+QList<struct RailsOutgoing> gOutbox;
+bool gOutboxPosted;
+
+/* The UI thread's copy of the peer table, process ID to name.  It is kept
+ * up to date by the peer events in each batch.
+ */
+QHash<qint64, QString> gPeers;
+
+/* gConsole serves two purposes as a global.  First, it allows us to properly
+ * clean up when the plugin is terminated.  Second, it enables the plugin
+ * to bring the containing window to the front of the stack when an external
+ * jump occurs.
+ *
+ * This global must ONLY be used through the rails_mesg() and bring_to_front()
+ * functions except when creating the console and ensuring that it is NULL.
+ */
+QTextBrowser *gConsole;
+
+/* Messages are read when the communication center signals that one has been
+ * posted.  As a fallback the plugin also polls it on a slow timer.  The timer
+ * is a global to allow for it to be unregistered (and thus prevent further
+ * access to the shared region) when the plugin is terminated.
+ */
+qtimer_t gTimer;
+
+QListWidget *gInstanceList;
+
+/* Work on the UI thread is done by tasks which do a little at a time.  A
+ * task's step function does the next piece of its work and returns true
+ * if there is more to do.  The pump runs the tasks in turn, a step each,
+ * for at most gPumpMaxMsgs steps or gPumpMaxMsecs per slice and leaves the
+ * rest for the next slice.  Both limits can be set with the 
+ * RAILS_PUMP_MSGS and RAILS_PUMP_MSECS environment variables.
+ *
+ * Requests handed over by the worker become tasks, as does building the
+ * symbol index.  A task whose deadline passes is cancelled, whoever asked
+ * for it has given up by then.
+ */
+struct RailsTask;
+typedef bool (*rails_step_fn)(struct RailsTask *task);
+
+struct RailsTask {
+    RailsTask() : rt_step(NULL), rt_lane(CommCenter::LaneInteractive),
+                  rt_deadline(0), rt_stage(0), rt_pos(0) {}
+
+    rails_step_fn rt_step;
+    int rt_lane;                    /* Tasks in the interactive lane go 
+                                     * first.
+                                     */
+    qint64 rt_deadline;             /* Time the task is cancelled at, in 
+                                     * milliseconds since epoch, or 0.
+                                     */
+    MessageView rt_view;            /* Request being handled, if any. */
+    int rt_stage;                   /* Progress, up to the step function. */
+    qint64 rt_pos;
+    QList<QByteArray> rt_out;       /* Answer being put together, also up
+                                     * to the step function.
+                                     */
+};
+
+QList<struct RailsTask> gTasks;
+int gPumpMaxMsgs;
+int gPumpMaxMsecs;
+
+/* RailsResponder enables us to catch signals from the list view inside the 
+ * Rails UI.  They can be used to bring other instances of IDA to the front.
+ */
+RailsResponder *gResponder;
+
+/* gSplitter is the horizontal splitter used in the Rails UI.
+ * The only reason it is global is so that it can be accessed
+ * both from the creation point inside ui_callback() and
+ * the point where windows are brought to the front
+ * in bring_to_front().
+ */
+QSplitter *gSplitter;
+
+/* Requests name functions by their symbol.  Rather than walking every entry
+ * point for each request the plugin keeps a name to address index of the
+ * entry points and named functions in the database.  It is built in run()
+ * and kept current by idp_callback() as names and functions change.
+ * gSymbolNames maps the other way so that stale names can be dropped and
+ * gEntryPoints remembers which addresses must stay indexed when the
+ * function there is deleted.
+ */
+QHash<QByteArray, ea_t> gSymbolIndex;
+QHash<ea_t, QByteArray> gSymbolNames;
+QSet<ea_t> gEntryPoints;
+
+/* The names in the symbol index are published through gExports so that
+ * other instances can send their requests only to those instances able to
+ * answer them.  Changes to the index are republished by the timer rather
+ * than as they happen since auto-analysis tends to make a great many of
+ * them at once.
  */
+ExportDirectory *gExports;
+bool gExportsDirty;
+bool gIndexReady;                   /* Set once the index has been built. */
 
-#define RP_OP_SIZE    1   /* Rails Protocol OPeration Size (in bytes) */
+/* Map of imported names to the module, and ordinal within it, that they are
+ * imported from, and where the import is.  See rails_import_find().
+ */
+struct ImportRef {
+    QByteArray ir_module;
+    uval_t ir_ord;
+    ea_t ir_ea;
+};
+
+QHash<QByteArray, struct ImportRef> gImports;
+bool gImportsValid;
+
+/* Comments received from other instances, keyed by executable path and
+ * function name, so that asking again is answered without a round trip.
+ * An instance broadcasts a CMT_CHANGED when the comment of one of its 
+ * functions changes, or the function is renamed, and the entry is dropped.
+ * gCommentExes maps the instances we have comments from to their 
+ * executable.  Both are filled on the worker thread and looked up on the
+ * UI thread, hence the lock.
+ */
+typedef QPair<QByteArray, QByteArray> CommentKey;
+
+QMutex gCommentLock;
+QHash<CommentKey, QByteArray> gComments;
+QHash<qint64, QByteArray> gCommentExes;
+
+/* Instances keep the names and comments of the entry points they export in
+ * step with the databases that import them.  The owner keeps a log with an
+ * entry for each entry point whose name or comment has changed, or that 
+ * had a comment when the index was built.  Every change gives the entry 
+ * the next version, so gSyncOrder, the entries by version, holds no more
+ * than one version of each and the log never grows past the number of 
+ * entry points.  Instances that subscribe are sent the log from the 
+ * version they have, and the changes since are sent on to each of them 
+ * by the timer.  The page is encoded once and addressed to subscribers
+ * only, so instances that aren't interested never hear of it.
+ */
+struct SyncEntry {
+    SyncEntry() : se_version(0) {}
+
+    QByteArray se_orig;             /* Name exported under, which is what
+                                     * importers know it by.
+                                     */
+    QByteArray se_name;
+    QByteArray se_cmt;
+    quint64 se_version;             /* 0 if unchanged. */
+};
+
+QHash<ea_t, struct SyncEntry> gSyncLog;
+QMap<quint64, ea_t> gSyncOrder;
+quint64 gSyncVersion;               /* Version of the latest change. */
+quint64 gSyncPushed;                /* Version last pushed. */
+QSet<qint64> gSyncSubs;             /* Instances subscribed to us. */
+
+/* The other side, instances whose exports we import and are subscribed to
+ * along with the version we are up to.  A subscription is pending from
+ * when it is sent until the last page of the answer is in or it times 
+ * out.  Deltas that don't follow on from sp_version are dropped and, 
+ * unless a subscription is pending, we subscribe again from sp_version.
+ */
+struct SyncPeer {
+    SyncPeer() : sp_version(0), sp_pending_until(0) {}
+
+    quint64 sp_version;
+    qint64 sp_pending_until;        /* Milliseconds since epoch. */
+};
+
+bool gSyncOn;
+bool gSyncApplying;                 /* Set while deltas are applied. */
+QHash<qint64, struct SyncPeer> gSyncPeers;
+
+/* -------------- Worker Batches -------------- */
+
+/* Called with gBatchLock held after adding to gBatch. */
+void rails_batch_post()
+{
+    if(gBatchPosted)
+        return;
+
+    gBatchPosted = true;
+    QMetaObject::invokeMethod(gResponder, "messagesPosted", 
+                              Qt::QueuedConnection);
+}
+
+void rails_batch_take(struct RailsBatch & batch)
+{
+    gBatchLock.lock();
+    batch = gBatch;
+    gBatch = RailsBatch();
+    gBatchPosted = false;
+    gBatchLock.unlock();
+}
+
+/* -------------- Rails Console -------------- */
+
+/* Messages from the worker thread are formatted there and shown once the 
+ * UI thread takes the batch.
+ */
+void rails_msg(const char *fmt, ...)
+{
+    QString msg_str;
+    va_list argp;
+
+    if(fmt == NULL)
+        return;
+
+    va_start(argp, fmt);
+    msg_str.vsprintf(fmt, argp);
+    va_end(argp);
+
+    if(QThread::currentThread() != gWorkerThread)
+    {
+        if(gConsole != NULL)
+            gConsole->append(msg_str);
+        return;
+    }
+
+    gBatchLock.lock();
+    gBatch.rb_console.append(msg_str);
+    rails_batch_post();
+    gBatchLock.unlock();
+}
+
+/* -------------- Sending -------------- */
+
+#define RAILS_SEND_WAIT     250   /* Milliseconds to wait for room to send */
+#define RAILS_SEND_LIFETIME 5000  /* Milliseconds after which a request is
+                                   * stale, the user has moved on by then.
+                                   */
+
+/* Messages are queued for the worker, which sends them.  If there is no 
+ * room for one it is the worker that waits, and it tells the user if the 
+ * message could not be sent.
+ */
+void rails_outbox_add(const struct RailsOutgoing & out)
+{
+    gOutboxLock.lock();
+    gOutbox.append(out);
+    if(!gOutboxPosted)
+    {
+        gOutboxPosted = true;
+        QMetaObject::invokeMethod(gWorker, "outboxPosted", 
+                                  Qt::QueuedConnection);
+    }
+    gOutboxLock.unlock();
+}
+
+/* Send msg to pid, or to every instance if pid is 0. */
+void rails_send(qint64 pid, const QByteArray & msg, 
+                CommCenter::Lane lane = CommCenter::LaneInteractive)
+{
+    struct RailsOutgoing out;
+
+    out.ro_kind = RAILS_OUT_SEND;
+    out.ro_pid = pid;
+    out.ro_msg = msg;
+    out.ro_lane = lane;
+    rails_outbox_add(out);
+}
+
+/* As rails_send() but the replies are collected and handled on the worker
+ * thread.
+ */
+void rails_call(qint64 pid, const QByteArray & msg,
+                CommCenter::Lane lane = CommCenter::LaneInteractive)
+{
+    struct RailsOutgoing out;
+
+    out.ro_kind = RAILS_OUT_CALL;
+    out.ro_pid = pid;
+    out.ro_msg = msg;
+    out.ro_lane = lane;
+    rails_outbox_add(out);
+}
+
+/* Answer request.  Only its header is kept, which is all a reply needs.
+ * An answer sent in pieces has more set on all but the last.
+ */
+void rails_reply(const struct Message *request, const QByteArray & msg,
+                 bool more = false)
+{
+    struct RailsOutgoing out;
+
+    out.ro_kind = RAILS_OUT_REPLY;
+    out.ro_pid = request->msg_from;
+    out.ro_msg = msg;
+    out.ro_more = more;
+    memcpy(&out.ro_request, request, offsetof(struct Message, msg_data));
+    out.ro_request.msg_size = 0;
+    rails_outbox_add(out);
+}
+
+/* -------------- Comment Cache -------------- */
+
+#define COMMENT_CACHE_MAX   4096    /* Most comments kept. */
+
+void rails_cmt_show(const char *exe, const char *func, const char *cmt)
+{
+    rails_msg("<b>Executable:</b> <code>%s</code>", exe);
+    rails_msg("<b>Function:</b> <code>%s</code>", func);
+    rails_msg("<b>Comment:</b> %s", cmt);
+}
+
+/* Remember the comment pid sent us.  When the cache is full an arbitrary
+ * entry makes way.  Called with gCommentLock held.
+ */
+void rails_comment_insert(qint64 pid, const RpCmtSet & set)
+{
+    CommentKey key(QByteArray(set.exe.data, set.exe.size),
+                   QByteArray(set.func.data, set.func.size));
+
+    if(gComments.size() >= COMMENT_CACHE_MAX && !gComments.contains(key))
+        gComments.erase(gComments.begin());
+
+    gComments.insert(key, QByteArray(set.cmt.data, set.cmt.size));
+    gCommentExes.insert(pid, key.first);
+}
+
+void rails_comment_store(qint64 pid, const RpCmtSet & set)
+{
+    gCommentLock.lock();
+    rails_comment_insert(pid, set);
+    gCommentLock.unlock();
+}
+
+/* A page of comments goes into the cache under a single lock. */
+void rails_comment_store_list(qint64 pid, const RpCmtList & list)
+{
+    quint32 func_pos, cmt_pos;
+    RpCmtSet set;
+
+    set.exe = list.exe;
+    func_pos = cmt_pos = 0;
+
+    gCommentLock.lock();
+    while(list.funcs.next(func_pos, set.func) 
+          && list.cmts.next(cmt_pos, set.cmt))
+    {
+        rails_comment_insert(pid, set);
+    }
+    gCommentLock.unlock();
+}
+
+void rails_comment_forget(const RpCmtChanged & changed)
+{
+    gCommentLock.lock();
+    gComments.remove(CommentKey(QByteArray(changed.exe.data, 
+                                           changed.exe.size),
+                                QByteArray(changed.func.data, 
+                                           changed.func.size)));
+    gCommentLock.unlock();
+}
+
+/* An instance that goes away won't tell us about changes made before it
+ * is opened again, so everything from it is dropped.
+ */
+void rails_comment_forget_peer(qint64 pid)
+{
+    QHash<CommentKey, QByteArray>::iterator i;
+    QByteArray exe;
+
+    gCommentLock.lock();
+    exe = gCommentExes.take(pid);
+    for(i = gComments.begin(); !exe.isEmpty() && i != gComments.end(); )
+    {
+        if(i.key().first == exe)
+            i = gComments.erase(i);
+        else
+            i++;
+    }
+    gCommentLock.unlock();
+}
+
+/* Shows the comment of func in pid's executable if it is cached.  Returns
+ * false if it is not.
+ */
+bool rails_comment_cached(qint64 pid, const char *func)
+{
+    QHash<CommentKey, QByteArray>::const_iterator i;
+    QByteArray exe, cmt;
+    bool found = false;
+
+    gCommentLock.lock();
+    exe = gCommentExes.value(pid);
+    i = gComments.constFind(CommentKey(exe, QByteArray(func)));
+    if(!exe.isEmpty() && i != gComments.constEnd())
+    {
+        cmt = i.value();
+        found = true;
+    }
+    gCommentLock.unlock();
+
+    if(found)
+        rails_cmt_show(exe.constData(), func, cmt.constData());
+
+    return found;
+}
+
+/* Tell everyone the comment of the function named func may have changed.
+ * Only indexed names are of interest to anyone else.
+ */
+void rails_comment_changed(const QByteArray & func)
+{
+    char path_buf[QMAXPATH];
+    RpCmtChanged changed;
+
+    if(func.isEmpty() || !gSymbolIndex.contains(func))
+        return;
+
+    bzero(path_buf, QMAXPATH);
+    get_input_file_path(path_buf, QMAXPATH);
+
+    changed.exe = path_buf;
+    changed.func = func;
+    rails_send(0, rp_encode(changed));
+}
+
+/* -------------- Rails Responder -------------- */
+
+void RailsResponder::instanceItemSelected(QListWidgetItem * item)
+{
+    RpNavOpenExe nav;
+    QByteArray exe_ba;
+
+    exe_ba = item->text().toUtf8();
+    nav.exe = exe_ba;
+
+    rails_send(item->data(Qt::UserRole).toLongLong(), rp_encode(nav));
+}
+
+/* -------------- Menu Item Callbacks -------------- */
+
+#define BUF_SIZE    128
+#define IDENT_FLAGS 0    /* from documentation in kernwin.hpp */
+
+/* Send a request about the symbol name to the instances that export it.
+ * If any instance has not published its exports we can't know whether it
+ * has the symbol, so the request is broadcast as before.  Requests that
+ * expect an answer are made with rails_call().  Owners for which cached()
+ * returns true, having answered from memory, are not asked.
+ */
+void rails_request(const char *name, const QByteArray & msg, 
+                   bool call = false, 
+                   bool (*cached)(qint64, const char *) = NULL)
+{
+    QList<qint64> pids, owners, unknown;
+    int i;
+
+    pids = gPeers.keys();
+    owners = gExports->owners(pids, QByteArray(name), &unknown);
+    if(!unknown.isEmpty())
+    {
+        owners.clear();
+        owners.append(0);
+    }
+    else if(owners.isEmpty())
+    {
+        rails_msg("No instance exports <code>%s</code>", name);
+        return;
+    }
+
+    for(i = 0; i < owners.size(); i++)
+    {
+        if(owners.at(i) != 0 && cached != NULL && cached(owners.at(i), name))
+            continue;
+
+        if(call)
+            rails_call(owners.at(i), msg);
+        else
+            rails_send(owners.at(i), msg);
+    }
+}
+
+/* Imports are looked up through gImports, which maps each imported name to
+ * the module providing it.  The map is built the first time it is needed and
+ * thrown away whenever the database changes in a way that could affect it.
+ */
+int enum_import_cb(ea_t ea, 
+                   const char *name, 
+                   uval_t ord, 
+                   void *param)
+{
+    assert(param != NULL);
+
+    struct ImportRef ref;
+
+    if(name != NULL)
+    {
+        ref.ir_module = *(QByteArray *)param;
+        ref.ir_ord = ord;
+        ref.ir_ea = ea;
+        gImports.insert(QByteArray(name), ref);
+    }
+
+    return 1;
+}
+
+void rails_imports_load()
+{
+    char mod_buf[BUF_SIZE];
+    QByteArray module;
+    int imp_qty, imp_id;
+
+    if(gImportsValid)
+        return;
+
+    gImports.clear();
+
+    imp_qty = get_import_module_qty();
+    for(imp_id = 0; imp_id < imp_qty; imp_id++)
+    {
+        bzero(mod_buf, BUF_SIZE);
+        get_import_module_name(imp_id, mod_buf, BUF_SIZE);
+
+        module = QByteArray(mod_buf);
+        enum_import_names(imp_id, enum_import_cb, (void *)&module);
+    }
+
+    gImportsValid = true;
+}
+
+bool rails_import_find(const char *name, struct ImportRef *ref)
+{
+    rails_imports_load();
+
+    QHash<QByteArray, struct ImportRef>::const_iterator i;
+    i = gImports.constFind(QByteArray(name));
+    if(i == gImports.constEnd())
+        return false;
+
+    *ref = i.value();
+    return true;
+}
+
+/* Find the instance that has the module providing an import open.  Module
+ * names may carry a path and instances are known by their root file name,
+ * so only the last path component is compared and the extension is ignored
+ * when one side doesn't have it.
+ */
+qint64 rails_import_peer(const QByteArray & module)
+{
+    QHash<qint64, QString>::const_iterator i;
+    QString mod_name, peer_name;
+
+    mod_name = QString(module).section('/', -1).section('\\', -1);
+    if(mod_name.isEmpty())
+        return 0;
+
+    for(i = gPeers.constBegin(); i != gPeers.constEnd(); i++)
+    {
+        peer_name = i.value();
+        if(peer_name.isEmpty())
+            continue;
+
+        if(peer_name.compare(mod_name, Qt::CaseInsensitive) == 0
+           || peer_name.section('.', 0, 0).compare(mod_name, 
+                                                    Qt::CaseInsensitive) == 0
+           || mod_name.section('.', 0, 0).compare(peer_name, 
+                                                   Qt::CaseInsensitive) == 0)
+        {
+            return i.key();
+        }
+    }
+
+    return 0;
+}
+
+bool rails_nav_cb(void *ud __attribute__((unused)))
+{
+    struct ImportRef imp;
+    RpNavOpenFunc nav;
+    char buf[BUF_SIZE];
+    qint64 pid;
+
+    bzero(buf, BUF_SIZE);
+    get_highlighted_identifier(buf, BUF_SIZE, IDENT_FLAGS);
+    nav.func = buf;
+
+    if(rails_import_find(buf, &imp))
+    {
+        rails_msg("Attempting to jump to <code>%s</code> in <code>%s</code>",
+                  buf, imp.ir_module.constData());
+
+        /* the instance with the module open is the one to ask */
+        pid = rails_import_peer(imp.ir_module);
+        if(pid != 0)
+        {
+            rails_send(pid, rp_encode(nav));
+            return true;
+        }
+    }
 
-/* Category: rails */
-#define RP_OP_RAILS_JOIN  0x01  /* OP<executable-path> */
-#define RP_OP_RAILS_KILL  0x02  /* OP<executable-path> */
-#define RP_OP_RAILS_PING  0x03  /* OP */
-#define RP_OP_RAILS_PONG  0x04  /* OP<executable-name> */
+    rails_request(buf, rp_encode(nav));
 
-/* Category: cmt */
-#define RP_OP_CMT_GET     0x11  /* OP<func-name> */
-#define RP_OP_CMT_SET     0x12  /* OP<executable-name>:<func-name>:<comment> */
+    return true;
+}
+
+bool rails_comments_cb(void *ud __attribute__((unused)))
+{
+    RpCmtGet get;
+    char buf[BUF_SIZE];
+
+    bzero(buf, BUF_SIZE);
+    get_highlighted_identifier(buf, BUF_SIZE, IDENT_FLAGS);
+    get.func = buf;
+
+    rails_request(buf, rp_encode(get), true, rails_comment_cached);
+
+    return true;
+}
+
+/* Asks the instance that has the module providing the highlighted import
+ * open for the comments of everything imported from that module.  Those 
+ * already cached are shown straight away and the rest are asked for in a
+ * single request.
+ */
+bool rails_module_comments_cb(void *ud __attribute__((unused)))
+{
+    QHash<QByteArray, struct ImportRef>::const_iterator i;
+    struct ImportRef imp;
+    RpCmtGetMany getn;
+    QByteArray names;
+    char buf[BUF_SIZE];
+    qint64 pid;
+
+    bzero(buf, BUF_SIZE);
+    get_highlighted_identifier(buf, BUF_SIZE, IDENT_FLAGS);
+
+    if(!rails_import_find(buf, &imp))
+    {
+        rails_msg("<code>%s</code> is not an import", buf);
+        return true;
+    }
+
+    pid = rails_import_peer(imp.ir_module);
+    if(pid == 0)
+    {
+        rails_msg("No instance has <code>%s</code> open", 
+                  imp.ir_module.constData());
+        return true;
+    }
+
+    for(i = gImports.constBegin(); i != gImports.constEnd(); i++)
+    {
+        if(i.value().ir_module != imp.ir_module)
+            continue;
+
+        if(!rails_comment_cached(pid, i.key().constData()))
+            RpStringList::append(names, i.key());
+    }
+
+    if(names.isEmpty())
+        return true;
+
+    getn.funcs = names;
+    rails_call(pid, rp_encode(getn));
+
+    return true;
+}
+
+/* -------------- Sync -------------- */
+
+/* Log a change to the name or comment of the entry point at ea, if it is
+ * one.
+ */
+void rails_sync_note(ea_t ea)
+{
+    QHash<ea_t, struct SyncEntry>::iterator i;
+    QByteArray name, cmt;
+    char *func_cmt;
+    func_t *func;
+
+    i = gSyncLog.find(ea);
+    if(i == gSyncLog.end())
+        return;
+
+    name = gSymbolNames.value(ea);
+    func = get_func(ea);
+    if(func != NULL)
+    {
+        func_cmt = get_func_cmt(func, false);
+        if(func_cmt != NULL)
+            cmt = func_cmt;
+        qfree(func_cmt);
+    }
+
+    if(name == i->se_name && cmt == i->se_cmt)
+        return;
+
+    if(i->se_version != 0)
+        gSyncOrder.remove(i->se_version);
+
+    i->se_name = name;
+    i->se_cmt = cmt;
+    i->se_version = ++gSyncVersion;
+    gSyncOrder.insert(i->se_version, ea);
+}
+
+/* Called for each entry point as the index is built. */
+void rails_sync_track(ea_t ea, const char *name)
+{
+    if(!gSyncLog.contains(ea))
+    {
+        struct SyncEntry & entry = gSyncLog[ea];
+
+        entry.se_orig = name;
+        entry.se_name = name;
+    }
+
+    rails_sync_note(ea);
+}
+
+/* Encodes the entries after version *pos as a SYNC_DELTA of about 
+ * SYNC_PAGE_SIZE bytes and moves *pos past them.  Returns true if there
+ * are more to come.
+ */
+#define SYNC_PAGE_SIZE  (MSG_FRAG_SIZE / 2)
+
+bool rails_sync_page(quint64 *pos, QByteArray & msg)
+{
+    QMap<quint64, ea_t>::const_iterator i;
+    QByteArray origs, names, cmts;
+    char path_buf[QMAXPATH];
+    RpSyncDelta delta;
+
+    delta.from = *pos;
+    for(i = gSyncOrder.upperBound(*pos); i != gSyncOrder.constEnd(); i++)
+    {
+        if(origs.size() + names.size() + cmts.size() >= SYNC_PAGE_SIZE)
+            break;
+
+        const struct SyncEntry & entry = *gSyncLog.constFind(i.value());
+        RpStringList::append(origs, entry.se_orig);
+        RpStringList::append(names, entry.se_name);
+        RpStringList::append(cmts, entry.se_cmt);
+        *pos = i.key();
+    }
+
+    if(i == gSyncOrder.constEnd())
+        *pos = gSyncVersion;
+
+    bzero(path_buf, QMAXPATH);
+    get_input_file_path(path_buf, QMAXPATH);
+
+    delta.exe = path_buf;
+    delta.origs = origs;
+    delta.names = names;
+    delta.cmts = cmts;
+    delta.to = *pos;
+    msg = rp_encode(delta);
+
+    return i != gSyncOrder.constEnd();
+}
+
+/* Send the changes made since the last push to everyone subscribed. */
+void rails_sync_push()
+{
+    QSet<qint64>::const_iterator i;
+    QByteArray msg;
+
+    if(gSyncSubs.isEmpty())
+        gSyncPushed = gSyncVersion;
+
+    while(gSyncPushed < gSyncVersion)
+    {
+        rails_sync_page(&gSyncPushed, msg);
+        for(i = gSyncSubs.constBegin(); i != gSyncSubs.constEnd(); i++)
+        {
+            rails_send(*i, msg, CommCenter::LaneBulk);
+        }
+    }
+}
+
+/* Subscribe to pid from the version we have, or unsubscribe. */
+void rails_sync_subscribe(qint64 pid, bool active)
+{
+    RpSyncSubscribe sub;
+
+    sub.since = gSyncPeers.value(pid).sp_version;
+    sub.active = active ? 1 : 0;
+
+    if(!active)
+    {
+        gSyncPeers.remove(pid);
+        rails_send(pid, rp_encode(sub), CommCenter::LaneBulk);
+        return;
+    }
+
+    gSyncPeers[pid].sp_pending_until = 
+        QDateTime::currentMSecsSinceEpoch() + CALL_TIMEOUT;
+    rails_call(pid, rp_encode(sub), CommCenter::LaneBulk);
+}
+
+/* Subscribe to pid if it has a module we import from open. */
+void rails_sync_peer(qint64 pid)
+{
+    QHash<QByteArray, struct ImportRef>::const_iterator i;
+    QSet<QByteArray> modules;
+
+    if(!gSyncOn || gSyncPeers.contains(pid))
+        return;
+
+    rails_imports_load();
+    for(i = gImports.constBegin(); i != gImports.constEnd(); i++)
+    {
+        if(modules.contains(i.value().ir_module))
+            continue;
+
+        modules.insert(i.value().ir_module);
+        if(rails_import_peer(i.value().ir_module) == pid)
+        {
+            rails_sync_subscribe(pid, true);
+            return;
+        }
+    }
+}
+
+bool rails_sync_cb(void *ud __attribute__((unused)))
+{
+    QHash<qint64, QString>::const_iterator i;
+    QList<qint64> pids;
+    int n;
+
+    gSyncOn = !gSyncOn;
+    if(gSyncOn)
+    {
+        for(i = gPeers.constBegin(); i != gPeers.constEnd(); i++)
+        {
+            rails_sync_peer(i.key());
+        }
+
+        rails_msg("Keeping imports in sync with %d instance(s)", 
+                  gSyncPeers.size());
+        return true;
+    }
+
+    pids = gSyncPeers.keys();
+    for(n = 0; n < pids.size(); n++)
+    {
+        rails_sync_subscribe(pids.at(n), false);
+    }
+
+    rails_msg("No longer keeping imports in sync");
+    return true;
+}
+
+/* -------------- Task Scheduler -------------- */
+
+/* Tasks are kept in lane order, a task goes after the others in its lane 
+ * so that tasks in the same lane take turns.
+ */
+void rails_task_add(const struct RailsTask & task)
+{
+    int pos = gTasks.size();
+
+    while(pos > 0 && gTasks.at(pos - 1).rt_lane > task.rt_lane)
+    {
+        pos--;
+    }
+
+    gTasks.insert(pos, task);
+}
+
+void rails_pump()
+{
+    struct RailsTask task;
+    QElapsedTimer elapsed;
+    int steps;
+
+    elapsed.start();
+    for(steps = 0; !gTasks.isEmpty(); steps++)
+    {
+        if(steps >= gPumpMaxMsgs || elapsed.elapsed() >= gPumpMaxMsecs)
+        {
+            /* out of budget, let the UI catch up before the next slice */
+            QTimer::singleShot(0, gResponder, SLOT(messagesPosted()));
+            break;
+        }
+
+        task = gTasks.takeFirst();
+        if(task.rt_deadline > 0 && 
+           QDateTime::currentMSecsSinceEpoch() >= task.rt_deadline)
+        {
+            continue;
+        }
+
+        if(task.rt_step(&task))
+            rails_task_add(task);
+    }
+}
+
+/* -------------- Symbol Index -------------- */
+
+/* Only functions given a name by the user or the loader are indexed.  The
+ * names IDA makes up, sub_XXXX and the like, say nothing about what a
+ * function is and would match unrelated functions in other databases.
+ */
+bool rails_index_named(ea_t ea)
+{
+    return !has_dummy_name(getFlags(ea));
+}
+
+void rails_index_remove(ea_t ea)
+{
+    QHash<ea_t, QByteArray>::iterator i = gSymbolNames.find(ea);
+    if(i == gSymbolNames.end())
+        return;
+
+    /* another address may have taken the name since */
+    QHash<QByteArray, ea_t>::iterator j = gSymbolIndex.find(i.value());
+    if(j != gSymbolIndex.end() && j.value() == ea)
+        gSymbolIndex.erase(j);
+
+    gSymbolNames.erase(i);
+    gExportsDirty = true;
+}
+
+void rails_index_add(ea_t ea, const char *name)
+{
+    rails_index_remove(ea);
+
+    if(name == NULL || *name == '\0')
+        return;
+
+    QByteArray key(name);
+    QHash<QByteArray, ea_t>::iterator j = gSymbolIndex.find(key);
+    if(j != gSymbolIndex.end())
+        gSymbolNames.remove(j.value());
+
+    gSymbolIndex.insert(key, ea);
+    gSymbolNames.insert(ea, key);
+    gExportsDirty = true;
+}
+
+ea_t rails_index_find(const char *name)
+{
+    return gSymbolIndex.value(QByteArray(name), BADADDR);
+}
+
+void rails_index_publish()
+{
+    if(gExports->publish(QCoreApplication::applicationPid(), 
+                         gSymbolIndex.keys()))
+    {
+        gExportsDirty = false;
+    }
+}
+
+/* The index is built INDEX_STEP_ENTRIES functions or entry points at a 
+ * time, named functions first so that entry point names win.  Changes 
+ * made in the meantime are picked up by idp_callback() as usual.
+ */
+#define INDEX_STEP_ENTRIES  256
+
+#define INDEX_STAGE_FUNCS   0
+#define INDEX_STAGE_ENTRIES 1
+
+bool rails_task_index(struct RailsTask *task)
+{
+    char name_buf[BUF_SIZE];
+    size_t n, end;
+    func_t *func;
+    uval_t ord;
+    ea_t ea;
+
+    if(task->rt_stage == INDEX_STAGE_FUNCS)
+    {
+        n = get_func_qty();
+        end = qMin(n, (size_t)task->rt_pos + INDEX_STEP_ENTRIES);
+        for(; (size_t)task->rt_pos < end; task->rt_pos++)
+        {
+            func = getn_func(task->rt_pos);
+            if(func == NULL)
+                continue;
+
+            if(rails_index_named(func->startEA)
+               && get_func_name(func->startEA, name_buf, BUF_SIZE) != NULL)
+                rails_index_add(func->startEA, name_buf);
+        }
+
+        if((size_t)task->rt_pos >= n)
+        {
+            task->rt_stage = INDEX_STAGE_ENTRIES;
+            task->rt_pos = 0;
+        }
+
+        return true;
+    }
+
+    n = get_entry_qty();
+    end = qMin(n, (size_t)task->rt_pos + INDEX_STEP_ENTRIES);
+    for(; (size_t)task->rt_pos < end; task->rt_pos++)
+    {
+        ord = get_entry_ordinal(task->rt_pos);
+        ea = get_entry(ord);
+        if(ea == BADADDR)
+            continue;
+
+        gEntryPoints.insert(ea);
+        if(get_entry_name(ord, name_buf, BUF_SIZE) > 0)
+        {
+            rails_index_add(ea, name_buf);
+            rails_sync_track(ea, name_buf);
+        }
+    }
+
+    if((size_t)task->rt_pos < n)
+        return true;
+
+    gIndexReady = true;
+    rails_index_publish();
+    return false;
+}
+
+void rails_index_build()
+{
+    struct RailsTask task;
+
+    gSymbolIndex.clear();
+    gSymbolNames.clear();
+    gEntryPoints.clear();
+    gSymbolIndex.reserve(get_func_qty() + get_entry_qty());
+    gIndexReady = false;
+
+    task.rt_step = rails_task_index;
+    task.rt_stage = INDEX_STAGE_FUNCS;
+    rails_task_add(task);
+    QTimer::singleShot(0, gResponder, SLOT(messagesPosted()));
+}
+
+static int idaapi idp_callback(void *user_data __attribute__((unused)),
+                               int notification_code,
+                               va_list va)
+{
+    if(notification_code == processor_t::renamed)
+    {
+        ea_t ea = va_arg(va, ea_t);
+        const char *new_name = va_arg(va, const char *);
+        bool local_name = va_arg(va, int) != 0;
+
+        /* the name may have been an import, those renamed by sync are 
+         * known to stay where they are
+         */
+        if(!gSyncApplying)
+            gImportsValid = false;
+
+        /* only names of functions and entry points are indexed */
+        if(local_name)
+            return 0;
+
+        func_t *func = get_func(ea);
+        if((func != NULL && func->startEA == ea) 
+           || gEntryPoints.contains(ea))
+        {
+            /* a comment cached under the old name is no longer reachable
+             * and might be found by the next function to take the name
+             */
+            rails_comment_changed(gSymbolNames.value(ea));
+            if(gEntryPoints.contains(ea) || rails_index_named(ea))
+                rails_index_add(ea, new_name);
+            else
+                rails_index_remove(ea);
+            rails_sync_note(ea);
+        }
+    }
+    else if(notification_code == processor_t::add_func)
+    {
+        func_t *func = va_arg(va, func_t *);
+        char name_buf[BUF_SIZE];
+
+        if(rails_index_named(func->startEA)
+           && get_func_name(func->startEA, name_buf, BUF_SIZE) != NULL)
+            rails_index_add(func->startEA, name_buf);
+    }
+    else if(notification_code == processor_t::del_func)
+    {
+        func_t *func = va_arg(va, func_t *);
+
+        if(!gEntryPoints.contains(func->startEA))
+            rails_index_remove(func->startEA);
+    }
+    else if(notification_code == processor_t::newfile
+            || notification_code == processor_t::oldfile
+            || notification_code == processor_t::closebase)
+    {
+        gImportsValid = false;
+    }
+
+    return 0;
+}
+
+/* Function comments are area comments in the funcs area control block. */
+static int idaapi idb_callback(void *user_data __attribute__((unused)),
+                               int notification_code,
+                               va_list va)
+{
+    if(notification_code == idb_event::area_cmt_changed)
+    {
+        areacb_t *cb = va_arg(va, areacb_t *);
+        const area_t *area = va_arg(va, const area_t *);
+
+        if(cb == &funcs && area != NULL)
+        {
+            rails_comment_changed(gSymbolNames.value(area->startEA));
+            rails_sync_note(area->startEA);
+        }
+    }
+
+    return 0;
+}
+
+/* -------------- Handling Rails Requests --------------- */
+
+void bring_to_front()
+{
+    QWidget *win;
+
+    if(gSplitter == NULL)
+        return;
+
+    win = gSplitter->window();
+    while(!win->isWindow())
+    {
+        win = win->window();
+    }
+
+    win->activateWindow();
+    win->raise();
+}
+
+void rails_nav_open_exe(CommCenter *cc __attribute__((unused)), 
+                        const struct Message *msgp __attribute__((unused)),
+                        const RpNavOpenExe & nav)
+{
+    char *name_buf = (char *)calloc(1, BUF_SIZE);
+    get_root_filename(name_buf, BUF_SIZE);
+
+    if(strcmp(nav.exe.data, name_buf) == 0)
+    {
+        bring_to_front();
+    }
+
+    free(name_buf);
+}
+
+void rails_nav_open_func(CommCenter *cc __attribute__((unused)), 
+                         const struct Message *msgp __attribute__((unused)),
+                         const RpNavOpenFunc & nav)
+{
+    ea_t func_ea;
+
+    func_ea = rails_index_find(nav.func.data);
+    if(func_ea != BADADDR)
+    {
+        jumpto(func_ea);
+        bring_to_front();
+    }
+}
+
+void rails_cmt_get(CommCenter *cc __attribute__((unused)), 
+                   const struct Message *msgp, const RpCmtGet & get)
+{
+    char path_buf[QMAXPATH];
+    char *func_cmt;
+    ea_t func_ea;
+    func_t *func;
+    RpCmtSet set;
+
+    /* answer even if we don't have the function, so that a caller which 
+     * asked everyone isn't left waiting for the timeout
+     */
+    set.func = get.func;
+    func_ea = rails_index_find(get.func.data);
+    func = (func_ea != BADADDR) ? get_func(func_ea) : NULL;
+    if(func == NULL)
+    {
+        rails_reply(msgp, rp_encode(set));
+        return;
+    }
 
-/* Category: nav */
-#define RP_OP_NAV_OFUN    0x21  /* OP<func-name> */
-#define RP_OP_NAV_OEXE    0x22  /* OP<exe-name> */
+    func_cmt = get_func_cmt(func, false);
 
-/* Utility macro's */
-#define RAILS_OP(p)      (*(char *)p)
-#define RAILS_DATA(p)    ((char *)p + 1)
+    bzero(path_buf, QMAXPATH);
+    get_input_file_path(path_buf, QMAXPATH);
 
-/* -------------- Globals -------------- */
+    /* messages are not limited in size so neither the path nor the comment 
+     * is cut short
+     */
+    set.exe = path_buf;
+    if(func_cmt != NULL)
+        set.cmt = func_cmt;
 
-/* The only reason for creating this global
- * variable is so that term() is able to 
- * access the CommCenter and properly disconnect.
- * Without doing this the shared memory region used
- * is not deleted upon disconnecting all clients.
- *
- * This is ONLY to be accessed using the global
- * identifier in term().  It is set to NULL in
- * init() and set to an allocated CommCenter in run()
- * all other access to CommCenter should be done through
- * the argument passed to the respective function.
- */
-CommCenter *gCommCenter = NULL;
+    rails_reply(msgp, rp_encode(set));
+    qfree(func_cmt);
+}
 
-/* gConsole serves two purposes as a global.  First, it allows us to properly
- * clean up when the plugin is terminated.  Second, it enables the plugin
- * to bring the containing window to the front of the stack when an external
- * jump occurs.
- *
- * This global must ONLY be used through the rails_mesg() and bring_to_front()
- * functions except when creating the console and ensuring that it is NULL.
+/* Comments are looked up CMT_LIST_STEP_FUNCS names at a time and sent back
+ * in pages of about CMT_LIST_PAGE_SIZE bytes, so that a page fits in a 
+ * single fragment.  A page is sent once it is full and the last one, which
+ * may be empty, when every name has been looked up.
  */
-QTextBrowser *gConsole;
+#define CMT_LIST_STEP_FUNCS 64
+#define CMT_LIST_PAGE_SIZE  (MSG_FRAG_SIZE / 2)
 
-/* In order to read messages the plugin polls the communication center.  This
- * is the timer used for polling. It is a global to allow for the timer to be
- * unregistered (and thus prevent further access to the shared region) when
- * the plugin is terminated.
- */
-qtimer_t gTimer;
+#define CMT_LIST_OUT_FUNCS  0
+#define CMT_LIST_OUT_CMTS   1
 
-QListWidget *gInstanceList;
+bool rails_task_cmt_list(struct RailsTask *task)
+{
+    const struct Message *msgp = task->rt_view.message();
+    char path_buf[QMAXPATH];
+    RpCmtGetMany getn;
+    RpCmtList list;
+    RpString name;
+    char *func_cmt;
+    ea_t func_ea;
+    func_t *func;
+    quint32 pos;
+    bool more;
+    int n;
 
-/* RailsResponder enables us to catch signals from the list view inside the 
- * Rails UI.  They can be used to bring other instances of IDA to the front.
- */
-RailsResponder *gResponder;
+    if(!gIndexReady)
+        return true;
 
-/* gSplitter is the horizontal splitter used in the Rails UI.
- * The only reason it is global is so that it can be accessed
- * both from the creation point inside ui_callback() and
- * the point where windows are brought to the front
- * in bring_to_front().
- */
-QSplitter *gSplitter;
+    if(!rp_decode(msgp, getn))
+    {
+        rails_msg("Rails: Malformed message (0x%x, version %d)\n", 
+                  rp_op(msgp), rp_version(msgp));
+        return false;
+    }
 
-/* -------------- Rails Console -------------- */
+    if(task->rt_out.isEmpty())
+        task->rt_out << QByteArray() << QByteArray();
 
-void rails_msg(const char *fmt, ...)
-{
-    QString msg_str;
-    va_list argp;
+    QByteArray & funcs = task->rt_out[CMT_LIST_OUT_FUNCS];
+    QByteArray & cmts = task->rt_out[CMT_LIST_OUT_CMTS];
 
-    if(gConsole == NULL || fmt == NULL)
-        return;
+    pos = (quint32)task->rt_pos;
+    for(n = 0; n < CMT_LIST_STEP_FUNCS && getn.funcs.next(pos, name); n++)
+    {
+        func_ea = rails_index_find(name.data);
+        if(func_ea == BADADDR)
+            continue;
 
-    va_start(argp, fmt);
-    gConsole->append(msg_str.vsprintf(fmt, argp));
-    va_end(argp);
-}
+        func = get_func(func_ea);
+        if(func == NULL)
+            continue;
 
-/* -------------- Rails Responder -------------- */
+        func_cmt = get_func_cmt(func, false);
+        if(func_cmt != NULL && *func_cmt != '\0')
+        {
+            RpStringList::append(funcs, name);
+            RpStringList::append(cmts, func_cmt);
+        }
+        qfree(func_cmt);
 
-void RailsResponder::instanceItemSelected(QListWidgetItem * item)
-{
-    QByteArray ba;
+        if(funcs.size() + cmts.size() >= CMT_LIST_PAGE_SIZE)
+            break;
+    }
 
-    ba.append(RP_OP_NAV_OEXE);
-    ba.append(item->text());
+    task->rt_pos = pos;
+    more = pos < getn.funcs.size;
+    if(more && funcs.size() + cmts.size() < CMT_LIST_PAGE_SIZE)
+        return true;
 
-    gCommCenter->broadcast(ba);
-}
+    bzero(path_buf, QMAXPATH);
+    get_input_file_path(path_buf, QMAXPATH);
 
-/* -------------- Menu Item Callbacks -------------- */
+    list.exe = path_buf;
+    list.funcs = funcs;
+    list.cmts = cmts;
+    list.page = task->rt_stage++;
+    rails_reply(msgp, rp_encode(list), more);
 
-#define BUF_SIZE    128
-#define IDENT_FLAGS 0    /* from documentation in kernwin.hpp */
+    funcs.clear();
+    cmts.clear();
+    return more;
+}
 
-struct _enum_import_data {
-    char *module_name;
-    char *highlighted_name;
-};
+/* Answers a subscription a page per step.  Changes made in the meantime
+ * are sent along as they come after the page being worked on.
+ */
+#define SYNC_STAGE_START    0
+#define SYNC_STAGE_PAGES    1
 
-int enum_import_cb(ea_t ea __attribute__((unused)), 
-                   const char *name, 
-                   uval_t ord __attribute__((unused)), 
-                   void *param)
+bool rails_task_sync(struct RailsTask *task)
 {
-    assert(param != NULL);
-    
-    struct _enum_import_data *match_info = (struct _enum_import_data *)param;
+    const struct Message *msgp = task->rt_view.message();
+    RpSyncSubscribe sub;
+    QByteArray msg;
+    quint64 pos;
+    bool more;
 
-    assert(match_info->module_name != NULL);
-    assert(match_info->highlighted_name != NULL);
+    if(!gIndexReady)
+        return true;
 
-    if(strcmp(match_info->highlighted_name, name) == 0)
+    if(!rp_decode(msgp, sub))
     {
-        rails_msg("Attempting to jump to <code>%s</code> in <code>%s</code>",
-                  name, match_info->module_name);
-        return 0;
+        rails_msg("Rails: Malformed message (0x%x, version %d)\n", 
+                  rp_op(msgp), rp_version(msgp));
+        return false;
     }
 
-    return 1;
+    if(task->rt_stage == SYNC_STAGE_START)
+    {
+        if(!sub.active)
+        {
+            gSyncSubs.remove(msgp->msg_from);
+            return false;
+        }
+
+        gSyncSubs.insert(msgp->msg_from);
+        task->rt_pos = (sub.since > gSyncVersion) ? 0 : sub.since;
+        task->rt_stage = SYNC_STAGE_PAGES;
+    }
+
+    pos = task->rt_pos;
+    more = rails_sync_page(&pos, msg);
+    task->rt_pos = pos;
+
+    rails_reply(msgp, msg, more);
+    return more;
 }
 
-bool rails_nav_cb(void *ud)
+/* A delta is applied to the imports from the instance that sent it in one
+ * go.  Names are only changed where the owner has renamed the function and
+ * comments are set as repeatable comments so that they show wherever the
+ * import is used.  A comment the owner removes is only removed here if it
+ * is still the one we were sent.
+ */
+void rails_sync_delta(CommCenter *cc __attribute__((unused)), 
+                      const struct Message *msgp, const RpSyncDelta & delta)
 {
-    assert(ud != NULL);
+    QHash<qint64, struct SyncPeer>::iterator peer;
+    quint32 orig_pos, name_pos, cmt_pos;
+    char name_buf[BUF_SIZE];
+    QList<RpCmtSet> sets;
+    struct ImportRef imp;
+    RpString orig, name;
+    QByteArray module;
+    RpCmtSet set;
+    int i;
 
-    CommCenter *cc = (CommCenter *)ud;          \
+    peer = gSyncPeers.find(msgp->msg_from);
+    if(peer == gSyncPeers.end())
+        return;
 
-    char *buf = (char *)calloc(1, BUF_SIZE);
-    if(!buf)
-    {
-        printf("Error: calloc\n");
-        return false;
-    }
+    if(msgp->msg_reply_to != 0 && !msgp->msg_more)
+        peer->sp_pending_until = 0;
 
-    *buf = RP_OP_NAV_OFUN;
-    get_highlighted_identifier(buf+RP_OP_SIZE, 
-                               BUF_SIZE-RP_OP_SIZE, 
-                               IDENT_FLAGS);
+    if(delta.to <= peer->sp_version)
+        return;
 
-    int imp_qty = get_import_module_qty();
-    char *imp_buf = (char *)calloc(1, BUF_SIZE);
-    if(!imp_buf)
+    if(delta.from > peer->sp_version)
     {
-        printf("Error: calloc\n");
-        return false;
+        /* something went missing on the way */
+        if(peer->sp_pending_until < QDateTime::currentMSecsSinceEpoch())
+            rails_sync_subscribe(msgp->msg_from, true);
+        return;
     }
 
-    int imp_id = 0;
-    struct _enum_import_data match_info;
-    for(imp_id = 0; imp_id < imp_qty; imp_id++)
+    set.exe = delta.exe;
+    orig_pos = name_pos = cmt_pos = 0;
+    gSyncApplying = true;
+    while(delta.origs.next(orig_pos, orig) 
+          && delta.names.next(name_pos, name)
+          && delta.cmts.next(cmt_pos, set.cmt))
     {
-        bzero(imp_buf, BUF_SIZE);
-        get_import_module_name(imp_id, imp_buf, BUF_SIZE);
+        if(!rails_import_find(orig.data, &imp) 
+           && !rails_import_find(name.data, &imp))
+            continue;
+
+        if(imp.ir_module != module)
+        {
+            if(rails_import_peer(imp.ir_module) != msgp->msg_from)
+                continue;
+            module = imp.ir_module;
+        }
+
+        if(name.size > 0 && strcmp(name.data, orig.data) != 0)
+        {
+            bzero(name_buf, BUF_SIZE);
+            get_true_name(BADADDR, imp.ir_ea, name_buf, BUF_SIZE);
+            if(strcmp(name_buf, name.data) != 0)
+                set_name(imp.ir_ea, name.data, SN_NOWARN);
+        }
+
+        set.func = orig;
+        if(set.cmt.size > 0)
+        {
+            set_cmt(imp.ir_ea, set.cmt.data, true);
+        }
+        else
+        {
+            gCommentLock.lock();
+            QByteArray old_cmt = gComments.value(
+                CommentKey(QByteArray(set.exe.data, set.exe.size),
+                           QByteArray(orig.data, orig.size)));
+            gCommentLock.unlock();
+
+            bzero(name_buf, BUF_SIZE);
+            get_cmt(imp.ir_ea, true, name_buf, BUF_SIZE);
+            if(!old_cmt.isEmpty() && old_cmt == name_buf)
+                set_cmt(imp.ir_ea, "", true);
+        }
 
-        match_info.module_name = imp_buf;
-        match_info.highlighted_name = buf + 1;  /* Skip the op byte */
+        sets.append(set);
+    }
+    gSyncApplying = false;
 
-        enum_import_names(imp_id, enum_import_cb, (void *)&match_info);
+    gCommentLock.lock();
+    for(i = 0; i < sets.size(); i++)
+    {
+        rails_comment_insert(msgp->msg_from, sets.at(i));
     }
+    gCommentLock.unlock();
 
-    cc->broadcast(QByteArray(buf));
-    free(buf);
-    free(imp_buf);
+    peer->sp_version = delta.to;
+    if(!sets.isEmpty())
+        refresh_idaview_anyway();
+}
 
-    return true;
+void rails_cmt_set(CommCenter *cc __attribute__((unused)), 
+                   const struct Message *msgp, const RpCmtSet & set)
+{
+    if(set.exe.size == 0)
+        return;
+
+    rails_comment_store(msgp->msg_from, set);
+    rails_cmt_show(set.exe.data, set.func.data, set.cmt.data);
 }
 
-bool rails_comments_cb(void *ud)
+void rails_cmt_list(CommCenter *cc __attribute__((unused)), 
+                    const struct Message *msgp, const RpCmtList & list)
 {
-    assert(ud != NULL);
+    quint32 func_pos, cmt_pos;
+    RpString func, cmt;
 
-    CommCenter *cc = (CommCenter *)ud;          \
+    rails_comment_store_list(msgp->msg_from, list);
 
-    char *buf = (char *)calloc(1, BUF_SIZE);
-    if(!buf)
+    func_pos = cmt_pos = 0;
+    while(list.funcs.next(func_pos, func) && list.cmts.next(cmt_pos, cmt))
     {
-        printf("Error: calloc\n");
-        return false;
+        rails_cmt_show(list.exe.data, func.data, cmt.data);
     }
 
-    *buf = RP_OP_CMT_GET;
-    get_highlighted_identifier(buf+RP_OP_SIZE, 
-                               BUF_SIZE-RP_OP_SIZE, 
-                               IDENT_FLAGS);
+    if(list.page == 0 && list.funcs.size == 0 && !msgp->msg_more)
+        rails_msg("No comments found in <code>%s</code>", list.exe.data);
+}
+
+void rails_cmt_changed(CommCenter *cc __attribute__((unused)), 
+                       const struct Message *msgp __attribute__((unused)),
+                       const RpCmtChanged & changed)
+{
+    rails_comment_forget(changed);
+}
 
-    cc->broadcast(QByteArray(buf));
-    free(buf);
+/* -------------- Rails Instances -------------- */
 
-    return true;
+/* Each item in the instance list stores the process ID of the 
+ * instance it represents under Qt::UserRole.
+ */
+int rails_peer_row(qint64 pid)
+{
+    int row;
+
+    for(row = 0; row < gInstanceList->count(); row++)
+    {
+        if(gInstanceList->item(row)->data(Qt::UserRole).toLongLong() == pid)
+            return row;
+    }
+
+    return -1;
 }
 
-/* -------------- Handling Rails Requests --------------- */
+void rails_peer_joined(qint64 pid, const QString & exe_name)
+{
+    QListWidgetItem *item;
 
-void bring_to_front()
+    if(gInstanceList == NULL || rails_peer_row(pid) >= 0)
+        return;
+
+    item = new QListWidgetItem(exe_name);
+    item->setData(Qt::UserRole, pid);
+    gInstanceList->addItem(item);
+}
+
+void rails_peer_left(qint64 pid)
 {
-    QWidget *win;
+    int row;
 
-    if(gSplitter == NULL)
+    if(gInstanceList == NULL)
         return;
 
-    win = gSplitter->window();
-    while(!win->isWindow())
-    {
-        win = win->window();
-    }
+    row = rails_peer_row(pid);
+    if(row < 0)
+        return;
 
-    win->activateWindow();
-    win->raise();
+    delete gInstanceList->takeItem(row);
+    gInstanceList->update();
 }
 
-void rails_nav_open_exe(const char *exe_name)
+/* Operations this instance handles.  Messages are decoded in place, the
+ * view keeps the message around until the handler returns.  Handlers in 
+ * gUiRoutes touch the database or the widgets and are run on the UI 
+ * thread, which has no CommCenter to pass them.  The others are run on the
+ * worker thread as messages are read.
+ */
+static const RpRoute gUiRoutes[] = {
+    RP_ROUTE(RpCmtGet, rails_cmt_get),
+    RP_ROUTE(RpNavOpenFunc, rails_nav_open_func),
+    RP_ROUTE(RpNavOpenExe, rails_nav_open_exe),
+    RP_ROUTE(RpSyncDelta, rails_sync_delta)
+};
+
+static const RpRoute gWorkerRoutes[] = {
+    RP_ROUTE(RpCmtSet, rails_cmt_set),
+    RP_ROUTE(RpCmtList, rails_cmt_list),
+    RP_ROUTE(RpCmtChanged, rails_cmt_changed)
+};
+
+/* Requests that take more than one step to answer have a step function 
+ * in place of a handler.  They are run on the UI thread as well.
+ */
+struct RailsTaskRoute {
+    int op;
+    rails_step_fn step;
+};
+
+static const struct RailsTaskRoute gTaskRoutes[] = {
+    { RpCmtGetMany::op, rails_task_cmt_list },
+    { RpSyncSubscribe::op, rails_task_sync }
+};
+
+rails_step_fn rails_task_route(int op)
 {
-    char *name_buf = (char *)calloc(1, BUF_SIZE);
-    get_root_filename(name_buf, BUF_SIZE);
+    size_t i;
 
-    if(strcmp(exe_name, name_buf) == 0)
+    for(i = 0; i < sizeof(gTaskRoutes) / sizeof(gTaskRoutes[0]); i++)
     {
-        bring_to_front();
+        if(gTaskRoutes[i].op == op)
+            return gTaskRoutes[i].step;
     }
 
-    free(name_buf);
+    return NULL;
 }
 
-void rails_nav_open_func(const char *func_name)
+template <int N>
+void processMessage(const RpRoute (&routes)[N], CommCenter *cc, 
+                    const MessageView & view)
 {
-    char *entry_buf;
-    size_t n_entry_points;
-    unsigned int i;
-    ea_t entry_ea;
-    uval_t ord;
+    const struct Message *msgp = view.message();
 
-    entry_buf = (char *)calloc(1, BUF_SIZE);
-    if(!entry_buf)
+    if(!msgp)
         return;
 
-    /* entry points */
-    n_entry_points = get_entry_qty();
-    for(i = 0; i < n_entry_points; i++)
+    switch(rp_dispatch(routes, cc, msgp))
     {
-        ord = get_entry_ordinal(i);
-        get_entry_name(ord, entry_buf, BUF_SIZE);
-        if(strcmp(entry_buf, func_name) == 0)
-        {
-            entry_ea = get_entry(ord);
-            jumpto(entry_ea);
-            bring_to_front();
-        }
+    case 0:
+        rails_msg("Rails: Malformed message (0x%x, version %d)\n", 
+                  rp_op(msgp), rp_version(msgp));
+        break;
+    case -1:
+        rails_msg("Rails: Unknown operation (0x%x)\n", rp_op(msgp));
+        break;
     }
 }
 
-void rails_cmt_get(CommCenter *cc, const char *func_name)
+/* -------------- Worker -------------- */
+
+/* Messages for the worker's own handlers are handled as they are read, 
+ * the rest are handed to the UI thread in one go.
+ */
+void rails_worker_dispatch(const QList<MessageView> & msgs)
 {
-    char *entry_buf, *cmt_buf;
-    char *func_cmt, *path_buf;
-    const char *set_cmt_fmt;
-    size_t n_entry_points;
-    unsigned int i;
-    ea_t entry_ea;
-    func_t *func;
-    uval_t ord;
+    QList<MessageView> ui_msgs;
+    const struct Message *msgp;
+    int i;
+
+    for(i = 0; i < msgs.size(); i++)
+    {
+        msgp = msgs.at(i).message();
+        if(msgp == NULL)
+            continue;
+
+        if(rp_handles(gUiRoutes, rp_op(msgp)) 
+           || rails_task_route(rp_op(msgp)) != NULL)
+            ui_msgs.append(msgs.at(i));
+        else
+            processMessage(gWorkerRoutes, gCommCenter, msgs.at(i));
+    }
 
-    entry_buf = (char *)calloc(1, BUF_SIZE);
-    if(!entry_buf)
+    if(ui_msgs.isEmpty())
         return;
 
-    /* entry points */
-    n_entry_points = get_entry_qty();
-    for(i = 0; i < n_entry_points; i++)
-    {
-        ord = get_entry_ordinal(i);
-        get_entry_name(ord, entry_buf, BUF_SIZE);
-        if(strcmp(entry_buf, func_name) == 0)
-        {
-            entry_ea = get_entry(ord);
-            func = get_func(entry_ea);
-            func_cmt = get_func_cmt(func, false);
-            
-            cmt_buf = (char *)calloc(1, BUF_SIZE);
-            if(!cmt_buf)
-            {
-                printf("Error: calloc\n");
-                free(entry_buf);
-                return;
-            }
+    gBatchLock.lock();
+    gBatch.rb_msgs += ui_msgs;
+    rails_batch_post();
+    gBatchLock.unlock();
+}
 
-            *cmt_buf = RP_OP_CMT_SET;
-            set_cmt_fmt = "%s:%s:%s";
+void rails_worker_peer(qint64 pid, const QString & name, bool joined)
+{
+    struct RailsPeerEvent ev;
 
-            path_buf = (char *)calloc(1, BUF_SIZE);
-            get_input_file_path(path_buf, BUF_SIZE);
+    ev.pv_pid = pid;
+    ev.pv_name = name;
+    ev.pv_joined = joined;
 
-            /* We need to use the scope operator with qsnprintf()
-             * because QT makes an equivalent function available
-             * and the compiler can't determine which we want
-             * (IDA version or QT's) to use.  Since the version
-             * provided by IDA is in the global namespace we don't
-             * give the scope operator any namespace.
-             */
-            ::qsnprintf(cmt_buf+RP_OP_SIZE, (size_t)BUF_SIZE, 
-                        (const char *)set_cmt_fmt, 
-                        (char *)path_buf,
-                        (char *)func_name, 
-                        (char *)func_cmt);
-
-            cc->broadcast(QByteArray(cmt_buf));
-            free(path_buf);
-            free(cmt_buf);
-        }
-    }
+    gBatchLock.lock();
+    gBatch.rb_peers.append(ev);
+    rails_batch_post();
+    gBatchLock.unlock();
+}
 
-    free(entry_buf);
+void RailsWorker::start(const QString & name)
+{
+    if(!gCommCenter->connect(name))
+        rails_msg("Rails: Could not connect to the other instances");
 }
 
-#define NR_DISP_FIELDS 3
-void rails_cmt_set(const char *cmt)
+/* The CommCenter has to go on the thread it lives on. */
+void RailsWorker::stop()
 {
-    char *token, *str;
-    int id;
+    gCommCenter->disconnect();
+    delete gCommCenter;
+    gCommCenter = NULL;
+}
 
-    const char *fields[NR_DISP_FIELDS] = {"<b>Executable:</b> <code>%s</code>"
-                                          , "<b>Function:</b> <code>%s</code>"
-                                          , "<b>Comment:</b> %s"};
+void RailsWorker::messagesPosted()
+{
+    QList<MessageView> msgs;
 
-    id = 0;
-    str = (char *)cmt;
-    while((token = strsep(&str, ":")) != NULL)
-    {
-        rails_msg(fields[id], token);
-        id++;
-    }
+    if(gCommCenter == NULL)
+        return;
+
+    gCommCenter->readMessages(msgs);
+    rails_worker_dispatch(msgs);
 }
 
-void rails_peer_joined(const char *peer_path)
+void RailsWorker::outboxPosted()
 {
-    QStringList list;
-    QString path(peer_path);
-    
-    list = path.split("\\");
-    if(list.isEmpty() || list.size() == 1)
+    QList<struct RailsOutgoing> outbox;
+    CommCenter::PostStatus status;
+    CommReply *reply;
+    int i;
+
+    gOutboxLock.lock();
+    outbox = gOutbox;
+    gOutbox.clear();
+    gOutboxPosted = false;
+    gOutboxLock.unlock();
+
+    if(gCommCenter == NULL)
+        return;
+
+    for(i = 0; i < outbox.size(); i++)
     {
-        list = path.split("/");
-        if(list.isEmpty())
-            return;
+        const struct RailsOutgoing & out = outbox.at(i);
+
+        switch(out.ro_kind)
+        {
+        case RAILS_OUT_SEND:
+            status = gCommCenter->sendWait(out.ro_pid, out.ro_msg, 
+                                           RAILS_SEND_WAIT, 
+                                           RAILS_SEND_LIFETIME, 
+                                           out.ro_lane);
+            if(status != CommCenter::PostOk)
+            {
+                rails_msg("Rails: Request not sent (%s)", 
+                          CommCenter::statusString(status));
+            }
+            break;
+        case RAILS_OUT_CALL:
+            reply = gCommCenter->call(out.ro_pid, out.ro_msg, CALL_TIMEOUT,
+                                      out.ro_lane);
+            if(reply == NULL)
+            {
+                rails_msg("Rails: Request not sent");
+                break;
+            }
+
+            QObject::connect(reply, SIGNAL(replied()), 
+                             this, SLOT(repliesReceived()));
+            QObject::connect(reply, SIGNAL(finished()), 
+                             reply, SLOT(deleteLater()));
+            break;
+        case RAILS_OUT_REPLY:
+            gCommCenter->reply(&out.ro_request, out.ro_msg, out.ro_more);
+            break;
+        }
     }
+}
+
+void RailsWorker::repliesReceived()
+{
+    CommReply *reply = qobject_cast<CommReply *>(sender());
+    if(reply == NULL)
+        return;
 
-    gInstanceList->addItem(list.last());
+    rails_worker_dispatch(reply->takeReplies());
 }
 
-void rails_peer_killed(const char *peer_path)
+void RailsWorker::peerJoined(qint64 pid, const QString & name)
 {
-    QStringList list;
-    QString path(peer_path);
-    QList<QListWidgetItem *> itemList;
+    rails_worker_peer(pid, name, true);
+}
 
-    list = path.split("\\");
-    if(list.isEmpty() || list.size() == 1)
-    {
-        list = path.split("/");
-        if(list.isEmpty())
-            return;
-    }
+void RailsWorker::peerLeft(qint64 pid, const QString & name)
+{
+    rails_comment_forget_peer(pid);
+    rails_worker_peer(pid, name, false);
+}
 
-    itemList = gInstanceList->findItems(list.last(), Qt::MatchExactly);
+/* -------------- Message Pump -------------- */
 
-    QList<QListWidgetItem *>::iterator i;
-    for (i = itemList.begin(); i != itemList.end(); i++)
-    {
-        gInstanceList->takeItem(gInstanceList->row(*i));
-        gInstanceList->update();
-    }
+#define PUMP_MAX_MSGS   32   /* task steps per slice */
+#define PUMP_MAX_MSECS  20   /* milliseconds per slice */
+
+int rails_pump_limit(const char *env_name, int def_val)
+{
+    bool ok;
+    int val = qgetenv(env_name).toInt(&ok);
 
+    return (ok && val > 0) ? val : def_val;
 }
 
-void rails_peer_ping(CommCenter *cc, qint64 pong_to)
+/* Requests are answered in a single step, but not before the symbol index
+ * they are looked up in is complete.
+ */
+bool rails_task_message(struct RailsTask *task)
 {
-    char *name_buf = (char *)calloc(1, BUF_SIZE);
-    *name_buf = RP_OP_RAILS_PONG;
-    get_root_filename(name_buf+RP_OP_SIZE, BUF_SIZE-RP_OP_SIZE);
-    cc->send(pong_to, QByteArray(name_buf));
-    free(name_buf);
+    if(!gIndexReady)
+        return true;
+
+    processMessage(gUiRoutes, NULL, task->rt_view);
+    return false;
 }
 
-void rails_peer_pong(const char *exe_name)
+/* Each request becomes a task in its lane, to be cancelled when it 
+ * expires.
+ */
+void rails_backlog_add(const QList<MessageView> & msgs)
 {
-    QList<QListWidgetItem *> itemsList;
+    struct RailsTask task;
+    int i;
 
-    itemsList = gInstanceList->findItems(QString(exe_name), Qt::MatchExactly);
-    if(itemsList.count() == 0)
+    for(i = 0; i < msgs.size(); i++)
     {
-        gInstanceList->addItem(QString(exe_name));
+        task.rt_step = rails_task_route(rp_op(msgs.at(i).message()));
+        if(task.rt_step == NULL)
+            task.rt_step = rails_task_message;
+
+        task.rt_lane = msgs.at(i)->msg_lane;
+        task.rt_deadline = msgs.at(i)->msg_expire;
+        task.rt_view = msgs.at(i);
+        rails_task_add(task);
     }
 }
 
-void processMessage(CommCenter *cc, struct Message *msgp)
+/* Takes the batch the worker has put together.  Peer events and console
+ * lines are dealt with straight away, messages go through the pump.
+ */
+void RailsResponder::messagesPosted()
 {
-    if(!msgp || !cc)
-        return;
+    struct RailsBatch batch;
+    int i;
+
+    rails_batch_take(batch);
+
+    for(i = 0; i < batch.rb_peers.size(); i++)
+    {
+        const struct RailsPeerEvent & ev = batch.rb_peers.at(i);
+
+        if(ev.pv_joined)
+        {
+            gPeers.insert(ev.pv_pid, ev.pv_name);
+            rails_peer_joined(ev.pv_pid, ev.pv_name);
+            rails_sync_peer(ev.pv_pid);
+        }
+        else
+        {
+            gPeers.remove(ev.pv_pid);
+            gSyncPeers.remove(ev.pv_pid);
+            gSyncSubs.remove(ev.pv_pid);
+            gExports->forget(ev.pv_pid);
+            rails_peer_left(ev.pv_pid);
+        }
+    }
+
+    for(i = 0; gConsole != NULL && i < batch.rb_console.size(); i++)
+    {
+        gConsole->append(batch.rb_console.at(i));
+    }
 
-    switch(RAILS_OP(msgp->msg_data))
-    {
-    case RP_OP_RAILS_JOIN: {
-        rails_peer_joined(RAILS_DATA(msgp->msg_data));
-    } break;
-    case RP_OP_RAILS_KILL: {
-        rails_peer_killed(RAILS_DATA(msgp->msg_data));
-    } break;
-    case RP_OP_RAILS_PING: {
-        rails_peer_ping(cc, msgp->msg_from);
-    } break;
-    case RP_OP_RAILS_PONG: {
-        rails_peer_pong(RAILS_DATA(msgp->msg_data));
-    } break;
-    case RP_OP_CMT_GET: {
-        rails_cmt_get(cc, RAILS_DATA(msgp->msg_data));
-    } break;
-    case RP_OP_CMT_SET: {
-        rails_cmt_set(RAILS_DATA(msgp->msg_data));
-    } break;
-    case RP_OP_NAV_OFUN: {
-        rails_nav_open_func(RAILS_DATA(msgp->msg_data));
-    } break;
-    case RP_OP_NAV_OEXE: {
-        rails_nav_open_exe(RAILS_DATA(msgp->msg_data));
-    } break;
-    default: 
-        rails_msg("Rails: Unknown operation (0x%x)\n", 
-                  RAILS_OP(msgp->msg_data));
-    };
-
-    free(msgp);
+    rails_backlog_add(batch.rb_msgs);
+    rails_pump();
 }
 
 /* -------------- Communication Timer -------------- */
 
-#define TIMER_INTERVAL  500  /* milliseconds */
+/* The timer only catches messages whose doorbell was missed, so it can run
+ * at a leisurely pace.  The worker is asked to have a look.
+ */
+#define TIMER_INTERVAL  5000  /* milliseconds */
 int idaapi timerExpired(void *ud)
 {
-    struct Message *msgp;
-    CommCenter *cc;
-    int i;
-
     assert(ud != NULL);
 
-    cc = (CommCenter *)ud;
+    QMetaObject::invokeMethod((RailsWorker *)ud, "messagesPosted", 
+                              Qt::QueuedConnection);
 
-    i = 0;
-    while((msgp = cc->readMessage(i)) == NULL)
+    if(gExportsDirty && gIndexReady)
     {
-        if(i >= MSG_MAX_COUNT)
-            break;
-
-        i++;
+        rails_index_publish();
     }
 
-    processMessage(cc, msgp);
+    gExports->expire();
+
+    if(gIndexReady)
+        rails_sync_push();
 
     return TIMER_INTERVAL;
 }
@@ -570,6 +2021,12 @@ static int idaapi ui_callback(void *user_data,
                              gResponder, 
                              SLOT(instanceItemSelected(QListWidgetItem *)));
 
+            QHash<qint64, QString>::const_iterator i;
+            for(i = gPeers.constBegin(); i != gPeers.constEnd(); i++)
+            {
+                rails_peer_joined(i.key(), i.value());
+            }
+
             QRect wGeo = wp->geometry();
             gSplitter->setGeometry(wGeo.x() + 5,
                                    wGeo.y() - 15,
@@ -597,45 +2054,98 @@ static int idaapi ui_callback(void *user_data,
 int idaapi init(void)
 {
     gCommCenter = NULL;
+    gWorkerThread = NULL;
+    gWorker = NULL;
+    gBatchPosted = false;
+    gOutboxPosted = false;
     gConsole = NULL;
     gSplitter = NULL;
     gTimer = NULL;
     gResponder = NULL;
     gInstanceList = NULL;
+    gExports = NULL;
+    gImportsValid = false;
+    gIndexReady = false;
+    gSyncVersion = 0;
+    gSyncPushed = 0;
+    gSyncOn = false;
+    gSyncApplying = false;
     return is_idaq() ? PLUGIN_OK : PLUGIN_SKIP;
 }
 
 void idaapi term(void)
 {
     unhook_from_notification_point(HT_UI, ui_callback);
+    unhook_from_notification_point(HT_IDP, idp_callback);
+    unhook_from_notification_point(HT_IDB, idb_callback);
 
     if(gTimer != NULL)
     {
         unregister_timer(gTimer);
     }
 
-    if(gCommCenter != NULL)
+    gTasks.clear();
+
+    if(gWorkerThread != NULL)
+    {
+        QMetaObject::invokeMethod(gWorker, "stop", 
+                                  Qt::BlockingQueuedConnection);
+        gWorkerThread->quit();
+        gWorkerThread->wait();
+
+        delete gWorker;
+        delete gWorkerThread;
+    }
+
+    /* the worker is gone so nothing is posted to the responder any more,
+     * deleting it also drops any pump or batch event still queued for it
+     */
+    delete gResponder;
+    gResponder = NULL;
+
+    if(gExports != NULL)
     {
-        char *path_buf = (char *)calloc(1, BUF_SIZE);
-        *path_buf = RP_OP_RAILS_KILL;
-        get_input_file_path(path_buf+RP_OP_SIZE, BUF_SIZE-RP_OP_SIZE);
-        gCommCenter->broadcast(QByteArray(path_buf));
-        free(path_buf);
-        
-        gCommCenter->disconnect();
-        delete gCommCenter;
+        delete gExports;
     }
 }
 
 void idaapi run(int arg __attribute__((unused)))
 {
-    gCommCenter = new CommCenter();
-    gCommCenter->connect();
+    char *name_buf = (char *)calloc(1, BUF_SIZE);
+    get_root_filename(name_buf, BUF_SIZE);
 
     gConsole = NULL;
-
     gResponder = new RailsResponder();
 
+    /* the CommCenter is connected on the worker thread so that everything
+     * it creates belongs to that thread
+     */
+    gWorkerThread = new QThread();
+    gWorker = new RailsWorker();
+    gCommCenter = new CommCenter();
+    gCommCenter->moveToThread(gWorkerThread);
+    gWorker->moveToThread(gWorkerThread);
+
+    QObject::connect(gCommCenter, SIGNAL(messagesPosted()),
+                     gWorker, SLOT(messagesPosted()));
+    QObject::connect(gCommCenter, SIGNAL(peerJoined(qint64, const QString &)),
+                     gWorker, SLOT(peerJoined(qint64, const QString &)));
+    QObject::connect(gCommCenter, SIGNAL(peerLeft(qint64, const QString &)),
+                     gWorker, SLOT(peerLeft(qint64, const QString &)));
+
+    gWorkerThread->start();
+    QMetaObject::invokeMethod(gWorker, "start", Qt::QueuedConnection,
+                              Q_ARG(QString, QString(name_buf)));
+    free(name_buf);
+
+    gExports = new ExportDirectory();
+    rails_index_build();
+    hook_to_notification_point(HT_IDP, idp_callback, NULL);
+    hook_to_notification_point(HT_IDB, idb_callback, NULL);
+
+    gPumpMaxMsgs = rails_pump_limit("RAILS_PUMP_MSGS", PUMP_MAX_MSGS);
+    gPumpMaxMsecs = rails_pump_limit("RAILS_PUMP_MSECS", PUMP_MAX_MSECS);
+
     HWND hwnd = NULL;
     TForm *form = create_tform("Rails", &hwnd);
     if(hwnd != NULL)
@@ -648,26 +2158,22 @@ void idaapi run(int arg __attribute__((unused)))
         close_tform(form, FORM_SAVE);
     }
 
-    char *path_buf = (char *)calloc(1, BUF_SIZE);
-    *path_buf = RP_OP_RAILS_JOIN;
-    get_input_file_path(path_buf+RP_OP_SIZE, BUF_SIZE-RP_OP_SIZE);
-    gCommCenter->broadcast(QByteArray(path_buf));
-    free(path_buf);
-
-    QByteArray getAlive;
-    getAlive.append(RP_OP_RAILS_PING);
-    gCommCenter->broadcast(getAlive);
-
     /* add menus */
     add_menu_item("Edit/Plugins", "Rails - Comments"
                   , "Alt-c", SETMENU_CTXAPP | SETMENU_INS
-                  , rails_comments_cb, (void *)gCommCenter);
+                  , rails_comments_cb, NULL);
+    add_menu_item("Edit/Plugins", "Rails - Module Comments"
+                  , "Alt-Shift-c", SETMENU_CTXAPP | SETMENU_INS
+                  , rails_module_comments_cb, NULL);
+    add_menu_item("Edit/Plugins", "Rails - Sync Imports"
+                  , "Alt-Shift-s", SETMENU_CTXAPP | SETMENU_INS
+                  , rails_sync_cb, NULL);
     add_menu_item("Edit/Plugins", "Rails - Jump"
                   , "Alt-j", SETMENU_CTXAPP | SETMENU_INS
-                  , rails_nav_cb, (void *)gCommCenter);
+                  , rails_nav_cb, NULL);
 
     /* add a timer */
-    gTimer = register_timer(TIMER_INTERVAL, timerExpired, gCommCenter);
+    gTimer = register_timer(TIMER_INTERVAL, timerExpired, gWorker);
 }
 
 const char *comment = "Interconnect IDA Instances";
@@ -0,0 +1,524 @@
+/*
+ * Plugin: Rails
+ * Author: Dean Pucsek <dean@lightbulbone.com>
+ * Date: 17 October 2026
+ *
+ * The Rails wire protocol.  Messages are encoded as an operation byte and a
+ * version byte followed by a sequence of tagged, length prefixed fields.
+ *
+ *
+ * Copyright (c) 2012, Dean Pucsek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the LightBulbOne nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __RAILS_PROTOCOL_HPP__
+#define __RAILS_PROTOCOL_HPP__
+
+#include <QByteArray>
+#include <QtGlobal>
+
+#include <string.h>
+
+#include "CommCenter.hpp"
+
+/* Every message starts with two bytes, the operation and the version of
+ * the protocol it was encoded with, followed by its fields:
+ *
+ *    +----+-----+-----+---------+-------------+-----+-----+---------+--
+ *    | op | ver | tag | len (4) | value (len) | tag | len | value   | ...
+ *    +----+-----+-----+---------+-------------+-----+-----+---------+--
+ *
+ * Lengths are little endian.  String values are followed by a NUL which is
+ * not counted in len, so a decoded string can be used where it lies in the
+ * received message without being copied.  Integers are 8 bytes long.
+ *
+ * Fields may appear in any order and tags a decoder doesn't know about are
+ * skipped, which leaves room to add fields without bumping RP_VERSION.  Tag
+ * 0 is never used so a string's NUL can't be mistaken for the next field.
+ */
+
+#define RP_VERSION      1
+#define RP_HEADER_SIZE  2   /* op and version */
+#define RP_FIELD_SIZE   5   /* tag and length */
+#define RP_MAX_TAGS     32
+
+/* Category: cmt */
+#define RP_OP_CMT_GET     0x11
+#define RP_OP_CMT_SET     0x12  /* sent as the reply to a CMT_GET */
+#define RP_OP_CMT_CHANGED 0x13  /* broadcast when a function comment may
+                                 * have changed
+                                 */
+#define RP_OP_CMT_GETN    0x14
+#define RP_OP_CMT_LIST    0x15  /* streamed as the replies to a CMT_GETN */
+
+/* Category: nav */
+#define RP_OP_NAV_OFUN    0x21
+#define RP_OP_NAV_OEXE    0x22
+
+/* Category: sync */
+#define RP_OP_SYNC_SUB    0x31
+#define RP_OP_SYNC_DELTA  0x32  /* streamed as the replies to a SYNC_SUB 
+                                 * and pushed to subscribers as changes 
+                                 * are made
+                                 */
+
+/* A string inside a message, or one about to be put into a message. */
+struct RpString {
+    RpString() : data(""), size(0) {}
+    RpString(const char *s) : data(s), size(strlen(s)) {}
+    RpString(const QByteArray & ba) : data(ba.constData()), size(ba.size()) {}
+
+    const char *data;               /* Always NUL terminated. */
+    quint32 size;
+};
+
+/* A list of strings, each followed by its NUL, one after the other.  Lists
+ * are built with append() and walked with next():
+ *
+ *    quint32 pos = 0;
+ *    RpString str;
+ *
+ *    while(list.next(pos, str))
+ *        ...
+ */
+struct RpStringList {
+    RpStringList() : data(""), size(0) {}
+    RpStringList(const QByteArray & ba) 
+        : data(ba.constData()), size(ba.size()) {}
+
+    static void append(QByteArray & ba, const RpString & str)
+    {
+        ba.append(str.data, str.size);
+        ba.append('\0');
+    }
+
+    bool next(quint32 & pos, RpString & str) const
+    {
+        if(pos >= size)
+            return false;
+
+        str.data = data + pos;
+        str.size = strlen(str.data);
+        pos += str.size + 1;
+        return true;
+    }
+
+    const char *data;               /* Ends with a NUL unless empty. */
+    quint32 size;                   /* Including the NULs. */
+};
+
+/* Messages.  Each lists its fields, by tag, in fields() which is used to 
+ * generate both its encoder and its decoder.
+ */
+struct RpCmtGet {
+    enum { op = RP_OP_CMT_GET };
+
+    RpString func;
+
+    template <class V> void fields(V & v) { v(1, func); }
+};
+
+/* An instance asked for a function it doesn't have answers without exe. */
+struct RpCmtSet {
+    enum { op = RP_OP_CMT_SET };
+
+    RpString exe;
+    RpString func;
+    RpString cmt;
+
+    template <class V> void fields(V & v) { v(1, exe); v(2, func); v(3, cmt); }
+};
+
+struct RpCmtChanged {
+    enum { op = RP_OP_CMT_CHANGED };
+
+    RpString exe;
+    RpString func;
+
+    template <class V> void fields(V & v) { v(1, exe); v(2, func); }
+};
+
+/* Asks for the comments of several functions at once.  The owner looks 
+ * them all up in one go and answers with a run of CMT_LIST replies, each
+ * holding a page of the comments found.
+ */
+struct RpCmtGetMany {
+    enum { op = RP_OP_CMT_GETN };
+
+    RpStringList funcs;
+
+    template <class V> void fields(V & v) { v(1, funcs); }
+};
+
+/* The nth entry of cmts is the comment of the nth entry of funcs.  Pages
+ * are numbered from 0, the last one is the reply without msg_more.
+ */
+struct RpCmtList {
+    RpCmtList() : page(0) {}
+
+    enum { op = RP_OP_CMT_LIST };
+
+    RpString exe;
+    RpStringList funcs;
+    RpStringList cmts;
+    quint64 page;
+
+    template <class V> void fields(V & v) 
+    { 
+        v(1, exe); v(2, funcs); v(3, cmts); v(4, page); 
+    }
+};
+
+struct RpNavOpenFunc {
+    enum { op = RP_OP_NAV_OFUN };
+
+    RpString func;
+
+    template <class V> void fields(V & v) { v(1, func); }
+};
+
+struct RpNavOpenExe {
+    enum { op = RP_OP_NAV_OEXE };
+
+    RpString exe;
+
+    template <class V> void fields(V & v) { v(1, exe); }
+};
+
+/* Subscribes to, or if active is 0 unsubscribes from, the changes made to
+ * the names and comments of the owner's entry points.  The owner answers
+ * with the changes made after version since as a run of SYNC_DELTA 
+ * replies.
+ */
+struct RpSyncSubscribe {
+    RpSyncSubscribe() : since(0), active(1) {}
+
+    enum { op = RP_OP_SYNC_SUB };
+
+    quint64 since;
+    quint64 active;
+
+    template <class V> void fields(V & v) { v(1, since); v(2, active); }
+};
+
+/* The changes made after version from, up to and including version to.
+ * Each entry point is listed by the name it is exported under, the nth 
+ * entry of names and cmts being its current name and comment.
+ */
+struct RpSyncDelta {
+    RpSyncDelta() : from(0), to(0) {}
+
+    enum { op = RP_OP_SYNC_DELTA };
+
+    RpString exe;
+    RpStringList origs;
+    RpStringList names;
+    RpStringList cmts;
+    quint64 from;
+    quint64 to;
+
+    template <class V> void fields(V & v) 
+    { 
+        v(1, exe); v(2, origs); v(3, names); v(4, cmts); 
+        v(5, from); v(6, to);
+    }
+};
+
+/* -------------- Encoding -------------- */
+
+class RpEncoder
+{
+public:
+    RpEncoder(QByteArray & ba) : out(ba) {}
+
+    void operator()(int tag, const RpString & str)
+    {
+        field(tag, str.size);
+        out.append(str.data, str.size);
+        out.append('\0');
+    }
+
+    void operator()(int tag, const RpStringList & list)
+    {
+        field(tag, list.size);
+        out.append(list.data, list.size);
+        out.append('\0');
+    }
+
+    void operator()(int tag, const quint64 & val)
+    {
+        int i;
+
+        field(tag, sizeof(quint64));
+        for(i = 0; i < (int)sizeof(quint64); i++)
+        {
+            out.append((char)(val >> (i * 8)));
+        }
+    }
+
+private:
+    void field(int tag, quint32 len)
+    {
+        int i;
+
+        out.append((char)tag);
+        for(i = 0; i < 4; i++)
+        {
+            out.append((char)(len >> (i * 8)));
+        }
+    }
+
+    QByteArray & out;
+};
+
+template <class M> QByteArray rp_encode(const M & msg)
+{
+    QByteArray ba;
+    RpEncoder enc(ba);
+
+    ba.append((char)M::op);
+    ba.append((char)RP_VERSION);
+    const_cast<M &>(msg).fields(enc);
+
+    return ba;
+}
+
+/* -------------- Decoding -------------- */
+
+/* The decoder first finds where each field is and then hands them out to
+ * the message as it lists its fields.  Nothing is copied; decoded strings
+ * point into the message they came from.
+ */
+class RpDecoder
+{
+public:
+    RpDecoder(const char *data, qint64 size) : base(data), ok(true)
+    {
+        qint64 pos;
+        quint32 len;
+        int tag, i;
+
+        memset(offsets, 0, sizeof(offsets));
+
+        pos = RP_HEADER_SIZE;
+        while(pos < size)
+        {
+            if(size - pos < RP_FIELD_SIZE)
+            {
+                ok = false;
+                return;
+            }
+
+            tag = (unsigned char)data[pos];
+            len = 0;
+            for(i = 0; i < 4; i++)
+            {
+                len |= (quint32)(unsigned char)data[pos + 1 + i] << (i * 8);
+            }
+
+            pos += RP_FIELD_SIZE;
+            if((qint64)len > size - pos)
+            {
+                ok = false;
+                return;
+            }
+
+            if(tag < RP_MAX_TAGS)
+            {
+                offsets[tag] = pos;
+                lengths[tag] = len;
+            }
+
+            /* a string's NUL follows it but is not part of len */
+            pos += len;
+            if(pos < size && data[pos] == '\0')
+                pos++;
+        }
+
+        end = size;
+    }
+
+    void operator()(int tag, RpString & str)
+    {
+        if(offsets[tag] == 0)
+            return;
+
+        if(offsets[tag] + lengths[tag] >= end 
+           || base[offsets[tag] + lengths[tag]] != '\0')
+        {
+            ok = false;
+            return;
+        }
+
+        str.data = base + offsets[tag];
+        str.size = lengths[tag];
+    }
+
+    /* The last string in a list must end with its NUL so that next() can't
+     * run off the end of it.
+     */
+    void operator()(int tag, RpStringList & list)
+    {
+        RpString str;
+
+        operator()(tag, str);
+        if(!ok || str.size == 0)
+            return;
+
+        if(str.data[str.size - 1] != '\0')
+        {
+            ok = false;
+            return;
+        }
+
+        list.data = str.data;
+        list.size = str.size;
+    }
+
+    void operator()(int tag, quint64 & val)
+    {
+        int i;
+
+        if(offsets[tag] == 0)
+            return;
+
+        if(lengths[tag] != sizeof(quint64))
+        {
+            ok = false;
+            return;
+        }
+
+        val = 0;
+        for(i = 0; i < (int)sizeof(quint64); i++)
+        {
+            val |= (quint64)(unsigned char)base[offsets[tag] + i] << (i * 8);
+        }
+    }
+
+    bool isValid() const { return ok; }
+
+private:
+    const char *base;
+    qint64 end;
+    qint64 offsets[RP_MAX_TAGS];    /* 0 if the field is not present */
+    quint32 lengths[RP_MAX_TAGS];
+    bool ok;
+};
+
+inline int rp_op(const struct Message *msgp)
+{
+    return msgp->msg_size > 0 ? (unsigned char)msgp->msg_data[0] : -1;
+}
+
+inline int rp_version(const struct Message *msgp)
+{
+    return msgp->msg_size > 1 ? (unsigned char)msgp->msg_data[1] : -1;
+}
+
+template <class M> bool rp_decode(const struct Message *msgp, M & msg)
+{
+    if(rp_op(msgp) != M::op || rp_version(msgp) != RP_VERSION)
+        return false;
+
+    RpDecoder dec(msgp->msg_data, msgp->msg_size);
+    if(!dec.isValid())
+        return false;
+
+    msg.fields(dec);
+    return dec.isValid();
+}
+
+/* -------------- Dispatch -------------- */
+
+/* Handlers take the decoded message along with the message it came from,
+ * which is needed to reply to it.  A dispatch table is built from entries 
+ * of the form
+ *
+ *     RP_ROUTE(RpCmtGet, rails_cmt_get)
+ *
+ * and rp_dispatch() finds the entry for a message's operation, decodes the
+ * message and calls the handler.
+ */
+typedef bool (*rp_route_fn)(CommCenter *, const struct Message *);
+
+struct RpRoute {
+    int op;
+    rp_route_fn route;
+};
+
+template <class M, 
+          void (*H)(CommCenter *, const struct Message *, const M &)>
+bool rp_route(CommCenter *cc, const struct Message *msgp)
+{
+    M msg;
+
+    if(!rp_decode(msgp, msg))
+        return false;
+
+    H(cc, msgp, msg);
+    return true;
+}
+
+#define RP_ROUTE(M, H)  { M::op, rp_route<M, H> }
+
+/* Returns 1 if the message was handled, 0 if it could not be decoded and
+ * -1 if its operation is not in the table.
+ */
+template <int N> 
+int rp_dispatch(const RpRoute (&routes)[N], CommCenter *cc, 
+                const struct Message *msgp)
+{
+    int op = rp_op(msgp);
+    int i;
+
+    for(i = 0; i < N; i++)
+    {
+        if(routes[i].op == op)
+            return routes[i].route(cc, msgp) ? 1 : 0;
+    }
+
+    return -1;
+}
+
+/* Returns true if the table has an entry for op. */
+template <int N>
+bool rp_handles(const RpRoute (&routes)[N], int op)
+{
+    int i;
+
+    for(i = 0; i < N; i++)
+    {
+        if(routes[i].op == op)
+            return true;
+    }
+
+    return false;
+}
+
+#endif /* __RAILS_PROTOCOL_HPP__ */
@@ -40,6 +40,7 @@
 #define __RAILS_RESPONDER_HPP__
 
 #include <QObject>
+#include <QString>
 #include <QListWidgetItem>
 
 class RailsResponder : public QObject
@@ -52,6 +53,7 @@ public:
 
 public slots:
     void instanceItemSelected(QListWidgetItem * item);
+    void messagesPosted();
 };
 
 #endif /* __RAILS_RESPONDER_HPP__ */
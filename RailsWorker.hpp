@@ -0,0 +1,67 @@
+/*
+ * Plugin: Rails
+ * Author: Dean Pucsek <dean@lightbulbone.com>
+ * Date: 17 October 2026
+ *
+ * Receive and send messages for the plugin on a thread of their own.
+ *
+ *
+ * Copyright (c) 2012, Dean Pucsek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the LightBulbOne nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __RAILS_WORKER_HPP__
+#define __RAILS_WORKER_HPP__
+
+#include <QObject>
+#include <QString>
+
+/* RailsWorker lives on the worker thread along with the CommCenter.  Its 
+ * slots are invoked either by the CommCenter or, queued, from the UI 
+ * thread.
+ */
+class RailsWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    RailsWorker() {};
+    ~RailsWorker() {};
+
+public slots:
+    void start(const QString & name);
+    void stop();
+    void messagesPosted();
+    void outboxPosted();
+    void repliesReceived();
+    void peerJoined(qint64 pid, const QString & name);
+    void peerLeft(qint64 pid, const QString & name);
+};
+
+#endif /* __RAILS_WORKER_HPP__ */
@@ -0,0 +1,186 @@
+/*
+ * Plugin: Rails
+ * Author: Dean Pucsek <dean@lightbulbone.com>
+ * Date: 17 October 2026
+ *
+ * A small mutex that lives in shared memory.  See SharedMutex.hpp.
+ *
+ *
+ * Copyright (c) 2012, Dean Pucsek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the LightBulbOne nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "SharedMutex.hpp"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
+#define SHARED_MUTEX_SPINS      100     /* Yields before a locker sleeps. */
+#define SHARED_MUTEX_WAIT_MSECS 10      /* Longest a waiter sleeps before 
+                                         * checking on the holder.
+                                         */
+#define SHARED_MUTEX_NAP_USECS  200     /* Sleep between checks where there
+                                         * is no futex.
+                                         */
+
+static qint64 mutex_self()
+{
+    quint64 tag = (quint32)(quintptr)pthread_self();
+
+    return (qint64)((tag << 32) | (quint32)getpid());
+}
+
+/* The pid might have been reused by now, in which case the holder is taken
+ * to be alive and the mutex stays held.  Peer leases have the same problem.
+ */
+static bool mutex_owner_alive(qint64 owner)
+{
+    pid_t pid = (pid_t)(owner & 0xffffffff);
+
+    if(pid == getpid())
+        return true;
+
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/* Sleep until the mutex is released, the wait times out or the holder is
+ * found to be gone.  sm_wake is read before the holder is checked again, so
+ * an unlock in between makes the futex return straight away.
+ */
+static void mutex_wait(struct SharedMutex *sm, qint64 owner)
+{
+    qint32 wake = *(volatile qint32 *)&sm->sm_wake;
+
+    __sync_fetch_and_add(&sm->sm_waiters, 1);
+    if(*(volatile qint64 *)&sm->sm_owner == owner)
+    {
+#ifdef __linux__
+        struct timespec ts;
+
+        ts.tv_sec = 0;
+        ts.tv_nsec = SHARED_MUTEX_WAIT_MSECS * 1000000L;
+        syscall(SYS_futex, &sm->sm_wake, FUTEX_WAIT, wake, &ts, NULL, 0);
+#else
+        (void)wake;
+        usleep(SHARED_MUTEX_NAP_USECS);
+#endif
+    }
+    __sync_fetch_and_sub(&sm->sm_waiters, 1);
+}
+
+static void mutex_wake(struct SharedMutex *sm)
+{
+    __sync_fetch_and_add(&sm->sm_wake, 1);
+#ifdef __linux__
+    syscall(SYS_futex, &sm->sm_wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+/* Takes the mutex from owner if owner has died. */
+static bool mutex_recover(struct SharedMutex *sm, qint64 owner, qint64 self)
+{
+    if(mutex_owner_alive(owner))
+        return false;
+
+    if(!__sync_bool_compare_and_swap(&sm->sm_owner, owner, self))
+        return false;
+
+    __sync_fetch_and_add(&sm->sm_recovered, 1);
+    return true;
+}
+
+int shared_mutex_lock(struct SharedMutex *sm)
+{
+    qint64 self = mutex_self();
+    qint64 owner;
+    bool contended = false;
+    int spins = 0;
+
+    for(;;)
+    {
+        owner = *(volatile qint64 *)&sm->sm_owner;
+        if(owner == 0)
+        {
+            if(__sync_bool_compare_and_swap(&sm->sm_owner, 0, self))
+                return SHARED_MUTEX_OK;
+            continue;
+        }
+
+        if(!contended)
+        {
+            __sync_fetch_and_add(&sm->sm_contended, 1);
+            contended = true;
+        }
+
+        if(spins < SHARED_MUTEX_SPINS)
+        {
+            spins++;
+            sched_yield();
+            continue;
+        }
+
+        if(mutex_recover(sm, owner, self))
+            return SHARED_MUTEX_RECOVERED;
+
+        mutex_wait(sm, owner);
+    }
+}
+
+int shared_mutex_trylock(struct SharedMutex *sm)
+{
+    qint64 self = mutex_self();
+    qint64 owner;
+
+    if(__sync_bool_compare_and_swap(&sm->sm_owner, 0, self))
+        return SHARED_MUTEX_OK;
+
+    owner = *(volatile qint64 *)&sm->sm_owner;
+    if(owner != 0 && mutex_recover(sm, owner, self))
+        return SHARED_MUTEX_RECOVERED;
+
+    return SHARED_MUTEX_BUSY;
+}
+
+void shared_mutex_unlock(struct SharedMutex *sm)
+{
+    __sync_lock_release(&sm->sm_owner);
+    __sync_synchronize();
+
+    if(*(volatile qint32 *)&sm->sm_waiters > 0)
+        mutex_wake(sm);
+}
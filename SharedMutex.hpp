@@ -0,0 +1,76 @@
+/*
+ * Plugin: Rails
+ * Author: Dean Pucsek <dean@lightbulbone.com>
+ * Date: 17 October 2026
+ *
+ * A small mutex that lives in shared memory.  It is taken with a single
+ * compare-and-swap when nobody holds it and is recovered when the process
+ * holding it dies.
+ *
+ *
+ * Copyright (c) 2012, Dean Pucsek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the LightBulbOne nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __SHARED_MUTEX_HPP__
+#define __SHARED_MUTEX_HPP__
+
+#include <QtGlobal>
+
+/* The owner word holds the pid of the holder in its low 32 bits and a tag
+ * for the holding thread in the high 32 bits, or zero when the mutex is 
+ * free.  A zeroed SharedMutex is unlocked, so one in a freshly created 
+ * segment needs no setup.
+ *
+ * Waiters sleep on sm_wake, which is bumped on every contended unlock.  
+ * They never sleep for long: a waiter wakes every few milliseconds to 
+ * check that the holder is still alive, and takes the mutex over if it is
+ * not.  The mutex is not recursive.
+ */
+struct SharedMutex
+{
+    qint64 sm_owner;
+    qint32 sm_wake;
+    qint32 sm_waiters;
+    qint64 sm_contended;            /* Locks that had to wait. */
+    qint64 sm_recovered;            /* Locks taken from a dead holder. */
+};
+
+#define SHARED_MUTEX_OK         0
+#define SHARED_MUTEX_RECOVERED  1   /* The previous holder died holding the
+                                     * mutex, whatever it protects may be 
+                                     * half updated.
+                                     */
+#define SHARED_MUTEX_BUSY       -1
+
+int shared_mutex_lock(struct SharedMutex *sm);
+int shared_mutex_trylock(struct SharedMutex *sm);
+void shared_mutex_unlock(struct SharedMutex *sm);
+
+#endif /* __SHARED_MUTEX_HPP__ */
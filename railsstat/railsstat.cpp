@@ -0,0 +1,306 @@
+/*
+ * Plugin: Rails
+ * Author: Dean Pucsek <dean@lightbulbone.com>
+ * Date: 17 October 2026
+ *
+ * railsstat: prints the statistics a running Rails session keeps in shared
+ * memory.  The segment is only read, and without taking the lock, so it is
+ * safe to point at a live session.
+ *
+ *
+ * Copyright (c) 2012, Dean Pucsek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the LightBulbOne nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* usage: railsstat [-i interval-secs] [-n count]
+ *
+ * With an interval the statistics are printed every interval seconds, 
+ * count times or until interrupted, along with the rate at which messages
+ * were posted and delivered since the previous sample.  Peers are listed
+ * with the largest backlog first, which is where to look for a slow one.
+ */
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QList>
+#include <QSharedMemory>
+#include <QtAlgorithms>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "CommCenterPrivate.hpp"
+
+static const char *lane_names[MSG_LANES] = { "interactive", "bulk" };
+
+/* A copy of the parts of the segment we report on.  Fields are changing 
+ * while they are copied so the numbers are only ever approximate.
+ */
+struct Sample
+{
+    qint64 when;
+    qint64 arena_avail;
+    qint64 depth[MSG_LANES];
+    qint64 lock_contended;
+    qint64 lock_recovered;
+    struct CommStats stats;
+};
+
+struct PeerSample
+{
+    qint64 pid;
+    qint64 backlog;
+    qint64 received;
+    qint64 lease;
+    char name[PEER_NAME_SIZE];
+};
+
+static bool peer_less(const PeerSample & a, const PeerSample & b)
+{
+    return a.backlog > b.backlog;
+}
+
+/* Count the messages still in the rings that are addressed to peer id and
+ * which it has not read.  Posting does not keep a count per peer, so the
+ * backlog is worked out from the routes here, at the cost of the sampler.
+ */
+static qint64 peer_backlog(const CommCenterPrivate *ccp, int id)
+{
+    const struct MsgLane *mlp;
+    const struct MsgRoute *route;
+    qint64 seq, backlog = 0;
+    int lane, i;
+
+    for(lane = 0; lane < MSG_LANES; lane++)
+    {
+        mlp = &ccp->lanes[lane];
+        for(i = 0; i < MSG_MAX_COUNT; i++)
+        {
+            /* only published slots hold a message */
+            seq = mlp->ring[i].slot_seq;
+            if(((seq - 1) & MSG_RING_MASK) != i)
+                continue;
+
+            route = &mlp->ring_route[i];
+            if((route->route_expect[PEER_WORD(id)] & 
+                ~route->route_read[PEER_WORD(id)] & PEER_BIT(id)) != 0)
+                backlog++;
+        }
+    }
+
+    return backlog;
+}
+
+static void take_sample(const CommCenterPrivate *ccp, struct Sample *s,
+                        QList<PeerSample> & peers)
+{
+    PeerSample ps;
+    int i;
+
+    s->when = QDateTime::currentMSecsSinceEpoch();
+    s->arena_avail = ccp->arena_avail;
+    for(i = 0; i < MSG_LANES; i++)
+    {
+        s->depth[i] = ccp->lanes[i].ring_depth;
+    }
+    s->lock_contended = ccp->roster_lock.sm_contended;
+    s->lock_recovered = ccp->roster_lock.sm_recovered;
+    memcpy(&s->stats, &ccp->stats, sizeof(s->stats));
+
+    peers.clear();
+    for(i = 0; i < MSG_MAX_PEERS; i++)
+    {
+        ps.pid = ccp->peers[i].pe_pid;
+        if(ps.pid == 0)
+            continue;
+
+        ps.backlog = peer_backlog(ccp, i);
+        ps.received = ccp->peers[i].pe_received;
+        ps.lease = ccp->peers[i].pe_lease;
+        memcpy(ps.name, ccp->peers[i].pe_name, PEER_NAME_SIZE);
+        ps.name[PEER_NAME_SIZE - 1] = '\0';
+        peers.append(ps);
+    }
+
+    qSort(peers.begin(), peers.end(), peer_less);
+}
+
+static void print_ops(const char *label, const struct OpStats *os)
+{
+    printf("%-12s %10lld %10lld %10lld %10lld\n", label, 
+           os->os_posted, os->os_delivered, os->os_dropped, os->os_expired);
+}
+
+static void print_sample(const struct Sample *s, const struct Sample *prev,
+                         const QList<PeerSample> & peers)
+{
+    const struct CommStats *st = &s->stats;
+    const struct OpStats *os;
+    double secs;
+    char label[16];
+    int i;
+
+    printf("rails: %d peers, arena %lld/%d blocks free (low %lld)\n\n",
+           peers.size(), s->arena_avail, MSG_MAX_BLOCKS, st->st_arena_low);
+
+    printf("%-12s %6s %6s", "lane", "depth", "peak");
+    if(prev != NULL)
+        printf(" %10s %10s", "posted/s", "deliv/s");
+    printf("\n");
+
+    secs = prev ? (s->when - prev->when) / 1000.0 : 0;
+    for(i = 0; i < MSG_LANES; i++)
+    {
+        printf("%-12s %6lld %6lld", lane_names[i], s->depth[i], 
+               st->st_lanes[i].ls_depth_peak);
+        if(prev != NULL && secs > 0)
+        {
+            os = &st->st_lanes[i].ls_totals;
+            printf(" %10.0f %10.0f",
+                   (os->os_posted - 
+                    prev->stats.st_lanes[i].ls_totals.os_posted) / secs,
+                   (os->os_delivered - 
+                    prev->stats.st_lanes[i].ls_totals.os_delivered) / secs);
+        }
+        printf("\n");
+    }
+
+    printf("\n%-12s %10s %10s %10s %10s\n", "", "posted", "delivered", 
+           "dropped", "expired");
+    for(i = 0; i < MSG_LANES; i++)
+    {
+        print_ops(lane_names[i], &st->st_lanes[i].ls_totals);
+    }
+    for(i = 0; i < STAT_OPS; i++)
+    {
+        os = &st->st_ops[i];
+        if(os->os_posted == 0 && os->os_delivered == 0 && 
+           os->os_dropped == 0 && os->os_expired == 0)
+            continue;
+
+        snprintf(label, sizeof(label), "op 0x%02x", i);
+        print_ops(label, os);
+    }
+
+    printf("\ncontention: %lld head retries, %lld busy spins, "
+           "%lld waits for room\n", st->st_head_retries, st->st_busy_spins,
+           st->st_room_waits);
+    printf("            %lld stale claims retired\n", st->st_stale_claims);
+    printf("lock: %lld taken, %.1f us average, %.1f us longest\n",
+           st->st_lock_count, 
+           st->st_lock_count ? 
+               st->st_lock_nsecs / 1000.0 / st->st_lock_count : 0.0,
+           st->st_lock_max_nsecs / 1000.0);
+    printf("      %lld contended, %lld taken from dead holders\n",
+           s->lock_contended, s->lock_recovered);
+
+    printf("\n%8s %-24s %10s %10s %10s\n", "pid", "name", "backlog", 
+           "received", "lease age");
+    for(i = 0; i < peers.size(); i++)
+    {
+        printf("%8lld %-24s %10lld %10lld %9.1fs\n", peers.at(i).pid, 
+               peers.at(i).name, peers.at(i).backlog, peers.at(i).received,
+               (s->when - peers.at(i).lease) / 1000.0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QSharedMemory shm(SHM_RAILS_KEY);
+    QList<PeerSample> peers;
+    struct Sample sample, prev;
+    int interval = 0, count = 1, n, opt;
+    bool count_set = false;
+
+    while((opt = getopt(argc, argv, "i:n:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            count_set = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-i interval-secs] [-n count]\n", 
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    /* with an interval and no count, sample until interrupted */
+    if(interval > 0 && !count_set)
+        count = -1;
+
+    if(!shm.attach(QSharedMemory::ReadOnly))
+    {
+        fprintf(stderr, "railsstat: no Rails session found (%s)\n",
+                shm.errorString().toLocal8Bit().constData());
+        return 1;
+    }
+
+    if((size_t)shm.size() < SHM_RAILS_SIZE)
+    {
+        fprintf(stderr, "railsstat: segment is %d bytes, expected %d; "
+                "built against a different version of Rails?\n", 
+                shm.size(), (int)SHM_RAILS_SIZE);
+        return 1;
+    }
+
+    if(((const CommCenterPrivate *)shm.constData())->init_done 
+       != SHM_RAILS_READY)
+    {
+        fprintf(stderr, "railsstat: the session is still starting up\n");
+        return 1;
+    }
+
+    for(n = 0; count < 0 || n < count; n++)
+    {
+        if(n > 0)
+        {
+            sleep(qMax(interval, 1));
+            printf("\n");
+        }
+
+        take_sample((const CommCenterPrivate *)shm.constData(), &sample, 
+                    peers);
+        print_sample(&sample, n > 0 ? &prev : NULL, peers);
+        fflush(stdout);
+
+        prev = sample;
+    }
+
+    shm.detach();
+    return 0;
+}
@@ -0,0 +1,670 @@
+/*
+ * Plugin: Rails
+ * Author: Dean Pucsek <dean@lightbulbone.com>
+ * Date: 17 October 2026
+ *
+ * Headless benchmark for CommCenter.  Measures throughput, delivery latency,
+ * drops, time spent posting and lock hold times for a number of 
+ * producer/consumer pairs and payload sizes.
+ *
+ *
+ * Copyright (c) 2012, Dean Pucsek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the LightBulbOne nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* For every combination of pair count and payload size the benchmark forks
+ * that many consumers, each of which connects and waits for messages, and 
+ * then the same number of producers.  Producer i sends its messages to
+ * consumer i with sendWait(), so a full ring holds producers back rather 
+ * than losing messages, unless the wait runs out.  Every message carries
+ * the time it was sent, taken from the monotonic clock which is shared by
+ * all processes, and consumers record how long each took to arrive.
+ *
+ * For each round the following are reported:
+ *
+ *   msgs_per_sec   messages received by all consumers per second, from 
+ *                  the moment the producers are let go to the last arrival
+ *   p50/p99/p999   delivery latency in microseconds
+ *   rejected       messages sendWait() gave up on
+ *   dropped        messages that were never received, including rejects
+ *   post_p50/p99   time in microseconds a producer spends inside 
+ *                  sendWait(), waits for room in the ring included.  This
+ *                  is not lock time, posting doesn't take a lock.
+ *   lock_taken     times the roster lock was taken during the round, and
+ *   lock_avg_us    how long it was held on average, from the statistics
+ *                  CommCenter keeps in the segment
+ *   lock_max_us    longest the roster lock has been held since the 
+ *                  segment was created, as of the end of the round
+ *
+ * usage: bench [-p pairs,...] [-s sizes,...] [-m messages] [-w wait-ms]
+ *              [-c results.csv] [-j results.json]
+ */
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QList>
+#include <QSharedMemory>
+#include <QStringList>
+#include <QThread>
+#include <QVector>
+#include <QtAlgorithms>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "CommCenter.hpp"
+#include "CommCenterPrivate.hpp"
+
+#define DEF_PAIRS       "1,2,4"
+#define DEF_SIZES       "16,256,4096,65536"
+#define DEF_MESSAGES    10000
+#define DEF_WAIT        1000        /* milliseconds sendWait() may block */
+#define DRAIN_IDLE      2000        /* milliseconds a consumer waits for 
+                                     * stragglers once it knows how many 
+                                     * messages were posted to it
+                                     */
+#define STAMP_SIZE      16          /* send time and sequence number */
+
+/* ---------- Results ---------- */
+
+struct ProducerResult
+{
+    qint64 attempted;
+    qint64 posted;
+    qint64 started;                 /* monotonic nanoseconds */
+};
+
+struct ConsumerResult
+{
+    qint64 received;
+    qint64 finished;                /* monotonic nanoseconds, last arrival */
+    qint64 nsamples;                /* followed by nsamples latencies */
+};
+
+struct RoundResult
+{
+    int pairs;
+    int size;
+    qint64 attempted;
+    qint64 posted;
+    qint64 received;
+    double msgs_per_sec;
+    double lat_p50, lat_p99, lat_p999;
+    double post_p50, post_p99;
+    qint64 lock_taken;
+    double lock_avg, lock_max;
+};
+
+static qint64 now_nsecs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (qint64)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    ssize_t n;
+
+    while(len > 0)
+    {
+        n = write(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+    ssize_t n;
+
+    while(len > 0)
+    {
+        n = read(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/* Returns the p'th percentile, in microseconds, of sorted nanosecond 
+ * samples.
+ */
+static double percentile(const QVector<qint64> & sorted, double p)
+{
+    int idx;
+
+    if(sorted.isEmpty())
+        return 0;
+
+    idx = qMin(sorted.size() - 1, (int)(p * sorted.size()));
+    return sorted.at(idx) / 1000.0;
+}
+
+/* ---------- Consumers ---------- */
+
+/* Reads until every message posted to us has arrived, or nothing has 
+ * arrived for DRAIN_IDLE once the parent has said how many to expect on
+ * ctl_fd.  Results and latency samples go back on res_fd.
+ */
+static void run_consumer(int ready_fd, int ctl_fd, int res_fd)
+{
+    struct ConsumerResult res;
+    QVector<qint64> samples;
+    QList<MessageView> msgs;
+    qint64 expected, stamp, now, idle_since;
+    qint64 pid;
+    int i;
+
+    CommCenter cc;
+    cc.connect();
+
+    pid = QCoreApplication::applicationPid();
+    if(!write_all(ready_fd, &pid, sizeof(pid)))
+        _exit(1);
+
+    fcntl(ctl_fd, F_SETFL, O_NONBLOCK);
+
+    res.received = 0;
+    res.finished = 0;
+    expected = -1;
+    idle_since = now_nsecs();
+
+    for(;;)
+    {
+        if(expected < 0 && read(ctl_fd, &expected, sizeof(expected)) 
+           != sizeof(expected))
+            expected = -1;
+
+        msgs.clear();
+        cc.readMessages(msgs, MSG_MAX_COUNT);
+
+        now = now_nsecs();
+        for(i = 0; i < msgs.size(); i++)
+        {
+            if(msgs.at(i)->msg_size < STAMP_SIZE)
+                continue;
+
+            memcpy(&stamp, msgs.at(i)->msg_data, sizeof(stamp));
+            samples.append(now - stamp);
+            res.received++;
+            res.finished = now;
+        }
+
+        if(!msgs.isEmpty())
+        {
+            idle_since = now;
+            continue;
+        }
+
+        if(expected >= 0 && res.received >= expected)
+            break;
+
+        if(expected >= 0 && (now - idle_since) / 1000000 >= DRAIN_IDLE)
+            break;
+
+        QThread::yieldCurrentThread();
+    }
+
+    res.nsamples = samples.size();
+    if(!write_all(res_fd, &res, sizeof(res)) ||
+       !write_all(res_fd, samples.constData(), 
+                  samples.size() * sizeof(qint64)))
+        _exit(1);
+
+    cc.disconnect();
+    _exit(0);
+}
+
+/* ---------- Producers ---------- */
+
+static void run_producer(qint64 dst_pid, int count, int size, int wait_ms,
+                         int go_fd, int res_fd)
+{
+    struct ProducerResult res;
+    QVector<qint64> post_times;
+    QByteArray msg(qMax(size, STAMP_SIZE), 'x');
+    qint64 stamp, seq, start;
+    char go;
+    int i;
+
+    CommCenter cc;
+    cc.connect();
+
+    /* wait for everyone to be ready */
+    if(!read_all(go_fd, &go, 1))
+        _exit(1);
+
+    res.attempted = count;
+    res.posted = 0;
+    res.started = now_nsecs();
+    post_times.reserve(count);
+
+    for(i = 0; i < count; i++)
+    {
+        seq = i;
+        start = now_nsecs();
+        memcpy(msg.data(), &start, sizeof(start));
+        memcpy(msg.data() + sizeof(stamp), &seq, sizeof(seq));
+
+        if(cc.sendWait(dst_pid, msg, wait_ms) == CommCenter::PostOk)
+            res.posted++;
+
+        post_times.append(now_nsecs() - start);
+    }
+
+    if(!write_all(res_fd, &res, sizeof(res)) ||
+       !write_all(res_fd, post_times.constData(), 
+                  post_times.size() * sizeof(qint64)))
+        _exit(1);
+
+    cc.disconnect();
+    _exit(0);
+}
+
+/* ---------- Rounds ---------- */
+
+static bool run_round(const CommCenterPrivate *ccp, int pairs, int size, 
+                      int count, int wait_ms, struct RoundResult *rr)
+{
+    qint64 lock_count, lock_nsecs;
+    QVector<qint64> latencies, post_times, samples;
+    QVector<qint64> consumer_pids;
+    struct ProducerResult pres;
+    struct ConsumerResult cres;
+    int ready[2], go[2];
+    QVector<int> ctl_fds, cres_fds, pres_fds;
+    qint64 started, finished, pid, posted;
+    int i, fds[2];
+
+    memset(rr, 0, sizeof(*rr));
+    rr->pairs = pairs;
+    rr->size = size;
+
+    lock_count = ccp->stats.st_lock_count;
+    lock_nsecs = ccp->stats.st_lock_nsecs;
+
+    if(pipe(ready) != 0 || pipe(go) != 0)
+        return false;
+
+    /* consumers first so they are in the peer table before anything is 
+     * sent to them
+     */
+    for(i = 0; i < pairs; i++)
+    {
+        int ctl[2], res[2];
+
+        if(pipe(ctl) != 0 || pipe(res) != 0)
+            return false;
+
+        pid = fork();
+        if(pid < 0)
+            return false;
+
+        if(pid == 0)
+        {
+            close(ctl[1]);
+            close(res[0]);
+            run_consumer(ready[1], ctl[0], res[1]);
+        }
+
+        close(ctl[0]);
+        close(res[1]);
+        ctl_fds.append(ctl[1]);
+        cres_fds.append(res[0]);
+    }
+
+    for(i = 0; i < pairs; i++)
+    {
+        if(!read_all(ready[0], &pid, sizeof(pid)))
+            return false;
+        consumer_pids.append(pid);
+    }
+
+    for(i = 0; i < pairs; i++)
+    {
+        if(pipe(fds) != 0)
+            return false;
+
+        pid = fork();
+        if(pid < 0)
+            return false;
+
+        if(pid == 0)
+        {
+            close(fds[0]);
+            run_producer(consumer_pids.at(i), count, size, wait_ms, 
+                         go[0], fds[1]);
+        }
+
+        close(fds[1]);
+        pres_fds.append(fds[0]);
+    }
+
+    /* give the producers a moment to connect, then let them go */
+    usleep(100000);
+    for(i = 0; i < pairs; i++)
+    {
+        if(!write_all(go[1], "g", 1))
+            return false;
+    }
+
+    started = -1;
+    for(i = 0; i < pairs; i++)
+    {
+        if(!read_all(pres_fds.at(i), &pres, sizeof(pres)))
+            return false;
+
+        samples.resize(pres.attempted);
+        if(!read_all(pres_fds.at(i), samples.data(), 
+                     samples.size() * sizeof(qint64)))
+            return false;
+
+        post_times += samples;
+        rr->attempted += pres.attempted;
+        rr->posted += pres.posted;
+        if(started < 0 || pres.started < started)
+            started = pres.started;
+
+        /* tell the consumer how many to wait for */
+        posted = pres.posted;
+        write_all(ctl_fds.at(i), &posted, sizeof(posted));
+        close(pres_fds.at(i));
+    }
+
+    finished = started;
+    for(i = 0; i < pairs; i++)
+    {
+        if(!read_all(cres_fds.at(i), &cres, sizeof(cres)))
+            return false;
+
+        samples.resize(cres.nsamples);
+        if(!read_all(cres_fds.at(i), samples.data(), 
+                     samples.size() * sizeof(qint64)))
+            return false;
+
+        latencies += samples;
+        rr->received += cres.received;
+        finished = qMax(finished, cres.finished);
+        close(cres_fds.at(i));
+        close(ctl_fds.at(i));
+    }
+
+    close(ready[0]);
+    close(ready[1]);
+    close(go[0]);
+    close(go[1]);
+    while(wait(NULL) > 0)
+        ;
+
+    qSort(latencies);
+    qSort(post_times);
+
+    if(finished > started)
+        rr->msgs_per_sec = rr->received * 1000000000.0 / (finished - started);
+    rr->lat_p50 = percentile(latencies, 0.50);
+    rr->lat_p99 = percentile(latencies, 0.99);
+    rr->lat_p999 = percentile(latencies, 0.999);
+    rr->post_p50 = percentile(post_times, 0.50);
+    rr->post_p99 = percentile(post_times, 0.99);
+
+    rr->lock_taken = ccp->stats.st_lock_count - lock_count;
+    if(rr->lock_taken > 0)
+        rr->lock_avg = (ccp->stats.st_lock_nsecs - lock_nsecs) / 1000.0 / 
+            rr->lock_taken;
+    rr->lock_max = ccp->stats.st_lock_max_nsecs / 1000.0;
+
+    return true;
+}
+
+/* ---------- Output ---------- */
+
+static void write_csv(FILE *fp, const QList<struct RoundResult> & rounds)
+{
+    int i;
+
+    fprintf(fp, "pairs,payload,attempted,posted,received,rejected,dropped,"
+            "drop_rate,msgs_per_sec,p50_us,p99_us,p999_us,"
+            "post_p50_us,post_p99_us,lock_taken,lock_avg_us,lock_max_us\n");
+
+    for(i = 0; i < rounds.size(); i++)
+    {
+        const struct RoundResult & r = rounds.at(i);
+
+        fprintf(fp, "%d,%d,%lld,%lld,%lld,%lld,%lld,%.6f,%.0f,"
+                "%.1f,%.1f,%.1f,%.1f,%.1f,%lld,%.1f,%.1f\n",
+                r.pairs, r.size, r.attempted, r.posted, r.received,
+                r.attempted - r.posted, r.attempted - r.received,
+                r.attempted ? 
+                    (double)(r.attempted - r.received) / r.attempted : 0,
+                r.msgs_per_sec, r.lat_p50, r.lat_p99, r.lat_p999,
+                r.post_p50, r.post_p99, r.lock_taken, r.lock_avg, 
+                r.lock_max);
+    }
+}
+
+static void write_json(FILE *fp, const QList<struct RoundResult> & rounds)
+{
+    int i;
+
+    fprintf(fp, "[\n");
+    for(i = 0; i < rounds.size(); i++)
+    {
+        const struct RoundResult & r = rounds.at(i);
+
+        fprintf(fp, "  {\"pairs\": %d, \"payload\": %d, \"attempted\": %lld, "
+                "\"posted\": %lld, \"received\": %lld, \"rejected\": %lld, "
+                "\"dropped\": %lld, \"drop_rate\": %.6f, "
+                "\"msgs_per_sec\": %.0f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+                "\"p999_us\": %.1f, \"post_p50_us\": %.1f, "
+                "\"post_p99_us\": %.1f, \"lock_taken\": %lld, "
+                "\"lock_avg_us\": %.1f, \"lock_max_us\": %.1f}%s\n",
+                r.pairs, r.size, r.attempted, r.posted, r.received,
+                r.attempted - r.posted, r.attempted - r.received,
+                r.attempted ? 
+                    (double)(r.attempted - r.received) / r.attempted : 0,
+                r.msgs_per_sec, r.lat_p50, r.lat_p99, r.lat_p999,
+                r.post_p50, r.post_p99, r.lock_taken, r.lock_avg, 
+                r.lock_max, (i + 1 < rounds.size()) ? "," : "");
+    }
+    fprintf(fp, "]\n");
+}
+
+static bool parse_list(const char *arg, QList<int> & out)
+{
+    QStringList parts = QString(arg).split(",");
+    bool ok;
+    int i, val;
+
+    out.clear();
+    for(i = 0; i < parts.size(); i++)
+    {
+        val = parts.at(i).toInt(&ok);
+        if(!ok || val <= 0)
+            return false;
+        out.append(val);
+    }
+
+    return !out.isEmpty();
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-p pairs,...] [-s sizes,...] [-m messages] "
+            "[-w wait-ms]\n"
+            "       [-c results.csv] [-j results.json]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QList<struct RoundResult> rounds;
+    struct RoundResult rr;
+    QList<int> pairs, sizes;
+    const char *csv_path = NULL, *json_path = NULL;
+    int count = DEF_MESSAGES, wait_ms = DEF_WAIT;
+    int i, j, opt;
+    FILE *fp;
+
+    parse_list(DEF_PAIRS, pairs);
+    parse_list(DEF_SIZES, sizes);
+
+    while((opt = getopt(argc, argv, "p:s:m:w:c:j:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'p':
+            if(!parse_list(optarg, pairs))
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            if(!parse_list(optarg, sizes))
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'm':
+            count = atoi(optarg);
+            break;
+        case 'w':
+            wait_ms = atoi(optarg);
+            break;
+        case 'c':
+            csv_path = optarg;
+            break;
+        case 'j':
+            json_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(count <= 0 || wait_ms < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* keep the segment alive between rounds, and read the lock statistics
+     * from it
+     */
+    CommCenter cc;
+    QSharedMemory shm(SHM_RAILS_KEY);
+    if(!shm.attach(QSharedMemory::ReadOnly) || 
+       (size_t)shm.size() < SHM_RAILS_SIZE)
+    {
+        fprintf(stderr, "FAIL: could not attach to the segment\n");
+        return 1;
+    }
+
+    printf("%6s %8s %12s %10s %10s %10s %8s %10s %10s\n", "pairs", 
+           "payload", "msgs/sec", "p50 us", "p99 us", "p999 us", "dropped",
+           "post p99", "lock avg");
+
+    for(i = 0; i < pairs.size(); i++)
+    {
+        for(j = 0; j < sizes.size(); j++)
+        {
+            if(!run_round((const CommCenterPrivate *)shm.constData(), 
+                          pairs.at(i), sizes.at(j), count, wait_ms, &rr))
+            {
+                fprintf(stderr, "FAIL: round with %d pairs and %d byte "
+                        "messages did not complete\n", 
+                        pairs.at(i), sizes.at(j));
+                return 1;
+            }
+
+            printf("%6d %8d %12.0f %10.1f %10.1f %10.1f %8lld %10.1f "
+                   "%10.1f\n", rr.pairs, rr.size, rr.msgs_per_sec, 
+                   rr.lat_p50, rr.lat_p99, rr.lat_p999, 
+                   rr.attempted - rr.received, rr.post_p99, rr.lock_avg);
+            fflush(stdout);
+
+            rounds.append(rr);
+        }
+    }
+
+    if(csv_path != NULL)
+    {
+        fp = fopen(csv_path, "w");
+        if(fp == NULL)
+        {
+            perror(csv_path);
+            return 1;
+        }
+        write_csv(fp, rounds);
+        fclose(fp);
+    }
+
+    if(json_path != NULL)
+    {
+        fp = fopen(json_path, "w");
+        if(fp == NULL)
+        {
+            perror(json_path);
+            return 1;
+        }
+        write_json(fp, rounds);
+        fclose(fp);
+    }
+
+    if(csv_path == NULL && json_path == NULL)
+        write_csv(stdout, rounds);
+
+    return 0;
+}
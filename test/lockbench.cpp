@@ -0,0 +1,369 @@
+/*
+ * Plugin: Rails
+ * Author: Dean Pucsek <dean@lightbulbone.com>
+ * Date: 17 October 2026
+ *
+ * Benchmark for the lock that protects the peer table.  Compares the
+ * SharedMutex kept in the segment with the QSharedMemory lock it replaced
+ * and checks that a SharedMutex is recovered from a holder that dies.
+ *
+ *
+ * Copyright (c) 2012, Dean Pucsek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the LightBulbOne nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* For each process count the benchmark forks that many lockers which all
+ * attach to one segment and, once let go, take the lock, bump a counter 
+ * kept in the segment and release it as many times as asked.  The counter
+ * is checked afterwards, so a lock that lets two holders in shows up as an
+ * error rather than as a good number.  For each lock and process count
+ * the following are reported:
+ *
+ *   ops_per_sec    lock/unlock pairs by all lockers per second
+ *   p50/p99/p999   time in microseconds to take the lock
+ *
+ * Last, a child takes the SharedMutex and exits without releasing it.  The
+ * parent must then get SHARED_MUTEX_RECOVERED, and how long that took is
+ * reported.
+ *
+ * usage: lockbench [-p procs,...] [-n locks]
+ */
+
+#include <QSharedMemory>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QtAlgorithms>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "SharedMutex.hpp"
+
+#define BENCH_KEY       "rails-lockbench"
+#define DEF_PROCS       "1,2,4,8"
+#define DEF_LOCKS       20000
+
+#define LOCK_QSHM       0
+#define LOCK_SHARED     1
+
+static const char *lock_names[] = { "qsharedmemory", "sharedmutex" };
+
+struct BenchSegment
+{
+    struct SharedMutex bs_mutex;
+    qint64 bs_counter;
+};
+
+static qint64 now_nsecs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (qint64)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    ssize_t n;
+
+    while(len > 0)
+    {
+        n = write(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+    ssize_t n;
+
+    while(len > 0)
+    {
+        n = read(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static double percentile(const QVector<qint64> & sorted, double p)
+{
+    int idx;
+
+    if(sorted.isEmpty())
+        return 0;
+
+    idx = qMin(sorted.size() - 1, (int)(p * sorted.size()));
+    return sorted.at(idx) / 1000.0;
+}
+
+/* ---------- Lockers ---------- */
+
+static void run_locker(int kind, int count, int go_fd, int res_fd)
+{
+    QSharedMemory shm(BENCH_KEY);
+    struct BenchSegment *bs;
+    QVector<qint64> waits;
+    qint64 start;
+    char go;
+    int i;
+
+    if(!shm.attach())
+        _exit(1);
+    bs = (struct BenchSegment *)shm.data();
+    waits.reserve(count);
+
+    if(!read_all(go_fd, &go, 1))
+        _exit(1);
+
+    for(i = 0; i < count; i++)
+    {
+        start = now_nsecs();
+        if(kind == LOCK_QSHM)
+            shm.lock();
+        else
+            shared_mutex_lock(&bs->bs_mutex);
+        waits.append(now_nsecs() - start);
+
+        bs->bs_counter++;
+
+        if(kind == LOCK_QSHM)
+            shm.unlock();
+        else
+            shared_mutex_unlock(&bs->bs_mutex);
+    }
+
+    if(!write_all(res_fd, waits.constData(), waits.size() * sizeof(qint64)))
+        _exit(1);
+
+    shm.detach();
+    _exit(0);
+}
+
+/* ---------- Rounds ---------- */
+
+static bool run_round(struct BenchSegment *bs, int kind, int procs, 
+                      int count)
+{
+    QVector<qint64> waits, samples;
+    QVector<int> res_fds;
+    qint64 started, elapsed;
+    int go[2], fds[2];
+    pid_t pid;
+    int i;
+
+    bs->bs_counter = 0;
+
+    if(pipe(go) != 0)
+        return false;
+
+    for(i = 0; i < procs; i++)
+    {
+        if(pipe(fds) != 0)
+            return false;
+
+        pid = fork();
+        if(pid < 0)
+            return false;
+
+        if(pid == 0)
+        {
+            close(fds[0]);
+            run_locker(kind, count, go[0], fds[1]);
+        }
+
+        close(fds[1]);
+        res_fds.append(fds[0]);
+    }
+
+    /* give the lockers a moment to attach, then let them go */
+    usleep(100000);
+    started = now_nsecs();
+    for(i = 0; i < procs; i++)
+    {
+        if(!write_all(go[1], "g", 1))
+            return false;
+    }
+
+    samples.resize(count);
+    for(i = 0; i < procs; i++)
+    {
+        if(!read_all(res_fds.at(i), samples.data(), 
+                     samples.size() * sizeof(qint64)))
+            return false;
+
+        waits += samples;
+        close(res_fds.at(i));
+    }
+    elapsed = now_nsecs() - started;
+
+    while(wait(NULL) > 0)
+        ;
+    close(go[0]);
+    close(go[1]);
+
+    qSort(waits);
+    printf("%-14s %5d %12.0f %9.2f %9.2f %9.2f%s\n", 
+           lock_names[kind], procs, 
+           (double)procs * count * 1000000000.0 / qMax(elapsed, 1LL),
+           percentile(waits, 0.50), percentile(waits, 0.99), 
+           percentile(waits, 0.999),
+           bs->bs_counter == (qint64)procs * count ? "" : "  COUNT MISMATCH");
+
+    return bs->bs_counter == (qint64)procs * count;
+}
+
+/* A child takes the mutex and exits holding it. */
+static bool check_recovery(struct BenchSegment *bs)
+{
+    qint64 start;
+    pid_t pid;
+    int rc;
+
+    pid = fork();
+    if(pid < 0)
+        return false;
+
+    if(pid == 0)
+    {
+        shared_mutex_lock(&bs->bs_mutex);
+        _exit(0);
+    }
+
+    waitpid(pid, NULL, 0);
+
+    start = now_nsecs();
+    rc = shared_mutex_lock(&bs->bs_mutex);
+    printf("recovery: %s after %.2f us, %lld recovered in total\n",
+           rc == SHARED_MUTEX_RECOVERED ? "recovered" : "NOT RECOVERED",
+           (now_nsecs() - start) / 1000.0, bs->bs_mutex.sm_recovered);
+    shared_mutex_unlock(&bs->bs_mutex);
+
+    return rc == SHARED_MUTEX_RECOVERED;
+}
+
+static QVector<int> parse_list(const char *arg)
+{
+    QStringList parts = QString(arg).split(",");
+    QVector<int> list;
+    int i, n;
+    bool ok;
+
+    for(i = 0; i < parts.size(); i++)
+    {
+        n = parts.at(i).toInt(&ok);
+        if(ok && n > 0)
+            list.append(n);
+    }
+
+    return list;
+}
+
+int main(int argc, char *argv[])
+{
+    QVector<int> procs = parse_list(DEF_PROCS);
+    QSharedMemory shm(BENCH_KEY);
+    struct BenchSegment *bs;
+    int count = DEF_LOCKS;
+    bool ok = true;
+    int c, i, kind;
+
+    while((c = getopt(argc, argv, "p:n:")) != -1)
+    {
+        switch(c)
+        {
+        case 'p':
+            procs = parse_list(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p procs,...] [-n locks]\n", 
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if(procs.isEmpty() || count <= 0)
+    {
+        fprintf(stderr, "%s: nothing to do\n", argv[0]);
+        return 1;
+    }
+
+    if(!shm.create(sizeof(struct BenchSegment)))
+    {
+        fprintf(stderr, "%s: cannot create segment %s\n", argv[0], 
+                BENCH_KEY);
+        return 1;
+    }
+    bs = (struct BenchSegment *)shm.data();
+    memset(bs, 0, sizeof(*bs));
+
+    printf("%-14s %5s %12s %9s %9s %9s\n", "lock", "procs", "ops_per_sec",
+           "p50", "p99", "p999");
+    for(i = 0; i < procs.size(); i++)
+    {
+        for(kind = LOCK_QSHM; kind <= LOCK_SHARED; kind++)
+        {
+            if(!run_round(bs, kind, procs.at(i), count))
+                ok = false;
+        }
+    }
+
+    printf("sharedmutex: %lld contended\n", bs->bs_mutex.sm_contended);
+    if(!check_recovery(bs))
+        ok = false;
+
+    shm.detach();
+    return ok ? 0 : 1;
+}
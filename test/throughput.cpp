@@ -0,0 +1,605 @@
+/*
+ * Plugin: Rails
+ * Author: Dean Pucsek <dean@lightbulbone.com>
+ * Date: 17 October 2026
+ *
+ * Headless throughput test comparing the lock-free CommCenter message ring
+ * with the original locked mailbox scan.
+ *
+ *
+ * Copyright (c) 2012, Dean Pucsek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the LightBulbOne nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* The test forks a number of producer processes, each paired with a reader
+ * of its own, and lets the producers post to their readers for a fixed 
+ * time, first through an emulation of the original QSharedMemory::lock() +
+ * nextMsgBox() path and then through CommCenter.  Both sides give every
+ * message the same lifetime, THROUGHPUT_LIFETIME.  A producer that finds 
+ * no room waits up to POST_WAIT for some before giving up on a message;
+ * any message given up on fails the test.  What is compared is the number
+ * of messages the readers received per second.
+ *
+ * usage: throughput [pairs] [seconds]
+ */
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QList>
+#include <QSharedMemory>
+#include <QElapsedTimer>
+#include <QThread>
+#include <QDebug>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CommCenter.hpp"
+
+#define DEF_PAIRS       4
+#define DEF_SECONDS     2
+
+#define THROUGHPUT_LIFETIME 1000    /* Lifetime (in milliseconds) of every 
+                                     * message, on both sides.
+                                     */
+#define POST_WAIT       (2 * THROUGHPUT_LIFETIME)
+                                    /* Longest (in milliseconds) a post may
+                                     * wait for room.
+                                     */
+#define DRAIN_IDLE      (2 * THROUGHPUT_LIFETIME)
+                                    /* Longest (in milliseconds) a reader 
+                                     * waits for stragglers once it knows 
+                                     * how many were posted to it.
+                                     */
+#define WAIT_USECS      1000        /* Sleep between legacy post retries. */
+
+#define LEGACY_KEY      "rails-throughput-legacy"
+#define LEGACY_COUNT    50
+#define LEGACY_DATA_SIZE 512
+
+/* ---------- Original Mailbox Path ---------- */
+
+struct LegacyMessage
+{
+    qint64 msg_time;
+    qint64 msg_read;
+    qint64 msg_from;
+    qint64 msg_to;
+    char msg_data[LEGACY_DATA_SIZE];
+};
+
+struct LegacyPrivate
+{
+    qint64 next_id;
+    qint64 nobservers;
+    struct LegacyMessage msgs[LEGACY_COUNT];
+};
+
+static int legacy_next_box(LegacyPrivate *lp)
+{
+    int msgBox;
+
+    for(msgBox = 0; msgBox < LEGACY_COUNT; msgBox++)
+    {
+        if((lp->msgs[msgBox]).msg_time == 0)
+        {
+            return msgBox;
+        }
+        else if((QDateTime::currentMSecsSinceEpoch() - \
+                 (lp->msgs[msgBox]).msg_time) >= THROUGHPUT_LIFETIME)
+        {
+            bzero(&(lp->msgs[msgBox]), sizeof(struct LegacyMessage));
+            return msgBox;
+        }
+    }
+
+    return -1;
+}
+
+static bool legacy_post(QSharedMemory & shm, qint64 dst_pid, 
+                        const QByteArray & msg_ba)
+{
+    struct LegacyMessage *mailbox;
+    LegacyPrivate *lp;
+    int msgBox;
+
+    shm.lock();
+    lp = (LegacyPrivate *)shm.data();
+
+    msgBox = legacy_next_box(lp);
+    if(msgBox < 0)
+    {
+        shm.unlock();
+        return false;
+    }
+
+    mailbox = &(lp->msgs[msgBox]);
+    mailbox->msg_time = QDateTime::currentMSecsSinceEpoch();
+    mailbox->msg_read = 0;
+    mailbox->msg_from = QCoreApplication::applicationPid();
+    mailbox->msg_to   = dst_pid;
+    memcpy(mailbox->msg_data, msg_ba.data(), 
+           qMin(msg_ba.size(), LEGACY_DATA_SIZE));
+
+    shm.unlock();
+    return true;
+}
+
+/* Posts, waiting up to POST_WAIT for room the way sendWait() does. */
+static bool legacy_post_wait(QSharedMemory & shm, qint64 dst_pid, 
+                             const QByteArray & msg_ba)
+{
+    qint64 wait_until;
+
+    wait_until = QDateTime::currentMSecsSinceEpoch() + POST_WAIT;
+    while(!legacy_post(shm, dst_pid, msg_ba))
+    {
+        if(QDateTime::currentMSecsSinceEpoch() >= wait_until)
+            return false;
+
+        usleep(WAIT_USECS);
+    }
+
+    return true;
+}
+
+/* Scans every mailbox, as readMessage() did for each in turn, and returns
+ * the number of messages read.
+ */
+static int legacy_read(QSharedMemory & shm)
+{
+    struct LegacyMessage *mailbox;
+    LegacyPrivate *lp;
+    qint64 pid, now;
+    int msgBox, nread = 0;
+
+    pid = QCoreApplication::applicationPid();
+
+    shm.lock();
+    lp = (LegacyPrivate *)shm.data();
+    now = QDateTime::currentMSecsSinceEpoch();
+
+    for(msgBox = 0; msgBox < LEGACY_COUNT; msgBox++)
+    {
+        mailbox = &(lp->msgs[msgBox]);
+        if(mailbox->msg_time == 0 || mailbox->msg_to != pid)
+            continue;
+
+        if((now - mailbox->msg_time) >= THROUGHPUT_LIFETIME)
+        {
+            bzero(mailbox, sizeof(struct LegacyMessage));
+            continue;
+        }
+
+        if(mailbox->msg_read != 0)
+            continue;
+
+        mailbox->msg_read = 1;
+        nread++;
+    }
+
+    shm.unlock();
+    return nread;
+}
+
+/* ---------- Readers ---------- */
+
+struct ProducerResult
+{
+    qint64 posted;
+    qint64 failed;
+};
+
+struct ReaderResult
+{
+    qint64 received;
+    qint64 nsecs;                   /* From the go signal to the last 
+                                     * message received.
+                                     */
+};
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    ssize_t n;
+
+    while(len > 0)
+    {
+        n = write(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+    ssize_t n;
+
+    while(len > 0)
+    {
+        n = read(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/* Reads until everything posted to us has arrived, or nothing has arrived
+ * for DRAIN_IDLE once the parent has said how many to expect on ctl_fd.
+ */
+static void run_reader(bool legacy, int ready_fd, int go_fd, int ctl_fd, 
+                       int res_fd)
+{
+    struct ReaderResult res;
+    QList<MessageView> msgs;
+    QSharedMemory shm(LEGACY_KEY);
+    CommCenter cc;
+    QElapsedTimer timer;
+    qint64 pid, expected, idle_since;
+    int n;
+    char go;
+
+    if(legacy)
+    {
+        if(!shm.attach())
+            _exit(1);
+    }
+    else if(!cc.connect())
+    {
+        _exit(1);
+    }
+
+    pid = QCoreApplication::applicationPid();
+    if(!write_all(ready_fd, &pid, sizeof(pid)) || !read_all(go_fd, &go, 1))
+        _exit(1);
+
+    fcntl(ctl_fd, F_SETFL, O_NONBLOCK);
+
+    timer.start();
+    res.received = 0;
+    res.nsecs = 0;
+    expected = -1;
+    idle_since = 0;
+
+    for(;;)
+    {
+        if(expected < 0 && read(ctl_fd, &expected, sizeof(expected)) 
+           != sizeof(expected))
+            expected = -1;
+
+        if(legacy)
+        {
+            n = legacy_read(shm);
+        }
+        else
+        {
+            msgs.clear();
+            n = cc.readMessages(msgs, MSG_MAX_COUNT);
+        }
+
+        if(n > 0)
+        {
+            res.received += n;
+            res.nsecs = timer.nsecsElapsed();
+            idle_since = timer.elapsed();
+            continue;
+        }
+
+        if(expected >= 0 && res.received >= expected)
+            break;
+
+        if(expected >= 0 && (timer.elapsed() - idle_since) >= DRAIN_IDLE)
+            break;
+
+        QThread::yieldCurrentThread();
+    }
+
+    if(!write_all(res_fd, &res, sizeof(res)))
+        _exit(1);
+
+    if(legacy)
+        shm.detach();
+    else
+        cc.disconnect();
+
+    _exit(0);
+}
+
+/* ---------- Producers ---------- */
+
+static void run_producer(bool legacy, qint64 dst_pid, int seconds, 
+                         int go_fd, int res_fd)
+{
+    struct ProducerResult res;
+    QByteArray msg("\x03throughput");
+    QSharedMemory shm(LEGACY_KEY);
+    CommCenter cc;
+    QElapsedTimer timer;
+    bool ok;
+    char go;
+
+    if(legacy)
+    {
+        if(!shm.attach())
+            _exit(1);
+    }
+    else if(!cc.connect())
+    {
+        _exit(1);
+    }
+
+    if(!read_all(go_fd, &go, 1))
+        _exit(1);
+
+    res.posted = 0;
+    res.failed = 0;
+
+    timer.start();
+    while(timer.elapsed() < seconds * 1000)
+    {
+        if(legacy)
+            ok = legacy_post_wait(shm, dst_pid, msg);
+        else
+            ok = (cc.sendWait(dst_pid, msg, POST_WAIT, THROUGHPUT_LIFETIME)
+                  == CommCenter::PostOk);
+
+        if(ok)
+            res.posted++;
+        else
+            res.failed++;
+    }
+
+    if(!write_all(res_fd, &res, sizeof(res)))
+        _exit(1);
+
+    if(legacy)
+        shm.detach();
+    else
+        cc.disconnect();
+
+    _exit(0);
+}
+
+/* ---------- Rounds ---------- */
+
+struct RoundResult
+{
+    qint64 posted;
+    qint64 failed;
+    qint64 received;
+    double rate;                    /* Messages received per second. */
+};
+
+/* Runs one round with producer i posting to reader i.  Returns false if a
+ * process could not be started or did not report back.
+ */
+static bool run_round(bool legacy, int pairs, int seconds, 
+                      struct RoundResult *rr)
+{
+    struct ProducerResult pres;
+    struct ReaderResult rres;
+    QList<int> ctl_fds, rres_fds, pres_fds;
+    QList<qint64> reader_pids, posted;
+    qint64 pid, nsecs;
+    int ready[2], go[2], fds[2];
+    int i;
+
+    memset(rr, 0, sizeof(*rr));
+
+    if(pipe(ready) != 0 || pipe(go) != 0)
+        return false;
+
+    /* readers first so they are in the peer table before anything is 
+     * posted to them
+     */
+    for(i = 0; i < pairs; i++)
+    {
+        int ctl[2], res[2];
+
+        if(pipe(ctl) != 0 || pipe(res) != 0)
+            return false;
+
+        pid = fork();
+        if(pid < 0)
+            return false;
+
+        if(pid == 0)
+        {
+            close(ctl[1]);
+            close(res[0]);
+            run_reader(legacy, ready[1], go[0], ctl[0], res[1]);
+        }
+
+        close(ctl[0]);
+        close(res[1]);
+        ctl_fds.append(ctl[1]);
+        rres_fds.append(res[0]);
+        reader_pids.append(pid);
+    }
+
+    for(i = 0; i < pairs; i++)
+    {
+        if(!read_all(ready[0], &pid, sizeof(pid)))
+            return false;
+    }
+
+    for(i = 0; i < pairs; i++)
+    {
+        if(pipe(fds) != 0)
+            return false;
+
+        pid = fork();
+        if(pid < 0)
+            return false;
+
+        if(pid == 0)
+        {
+            close(fds[0]);
+            run_producer(legacy, reader_pids.at(i), seconds, go[0], fds[1]);
+        }
+
+        close(fds[1]);
+        pres_fds.append(fds[0]);
+    }
+
+    /* give the producers a moment to connect, then let everyone go */
+    usleep(100000);
+    for(i = 0; i < 2 * pairs; i++)
+    {
+        if(!write_all(go[1], "g", 1))
+            return false;
+    }
+
+    for(i = 0; i < pairs; i++)
+    {
+        if(!read_all(pres_fds.at(i), &pres, sizeof(pres)))
+            return false;
+
+        rr->posted += pres.posted;
+        rr->failed += pres.failed;
+        posted.append(pres.posted);
+        close(pres_fds.at(i));
+    }
+
+    nsecs = 0;
+    for(i = 0; i < pairs; i++)
+    {
+        if(!write_all(ctl_fds.at(i), &posted.at(i), sizeof(qint64)) ||
+           !read_all(rres_fds.at(i), &rres, sizeof(rres)))
+            return false;
+
+        rr->received += rres.received;
+        nsecs = qMax(nsecs, rres.nsecs);
+        close(ctl_fds.at(i));
+        close(rres_fds.at(i));
+    }
+
+    close(ready[0]);
+    close(ready[1]);
+    close(go[0]);
+    close(go[1]);
+    while(wait(NULL) > 0)
+        ;
+
+    if(nsecs > 0)
+        rr->rate = (double)rr->received * 1000000000.0 / (double)nsecs;
+
+    return true;
+}
+
+static void print_round(const char *label, const struct RoundResult *rr)
+{
+    printf("%s %12.0f msgs/sec  (posted %lld, failed %lld, received %lld)\n",
+           label, rr->rate, rr->posted, rr->failed, rr->received);
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    struct RoundResult legacy_rr, ring_rr;
+    int pairs = DEF_PAIRS;
+    int seconds = DEF_SECONDS;
+
+    if(argc > 1)
+        pairs = atoi(argv[1]);
+    if(argc > 2)
+        seconds = atoi(argv[2]);
+
+    if(pairs <= 0 || seconds <= 0)
+    {
+        fprintf(stderr, "usage: %s [pairs] [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    /* keep both segments alive for the duration of the test */
+    QSharedMemory legacy(LEGACY_KEY);
+    if(!legacy.create(sizeof(LegacyPrivate)) && !legacy.attach())
+    {
+        qDebug() << "Error: legacy segment :: " << legacy.errorString();
+        return 1;
+    }
+    bzero(legacy.data(), sizeof(LegacyPrivate));
+
+    CommCenter cc;
+
+    if(!run_round(true, pairs, seconds, &legacy_rr) ||
+       !run_round(false, pairs, seconds, &ring_rr))
+    {
+        fprintf(stderr, "FAIL: a round did not complete\n");
+        return 1;
+    }
+
+    printf("pairs: %d, seconds: %d, lifetime: %d ms\n", pairs, seconds,
+           THROUGHPUT_LIFETIME);
+    print_round("locked mailbox:", &legacy_rr);
+    print_round("lock-free ring:", &ring_rr);
+
+    if(legacy_rr.failed > 0 || ring_rr.failed > 0)
+    {
+        printf("FAIL: posts were given up on\n");
+        return 1;
+    }
+
+    if(legacy_rr.received == 0 || ring_rr.received == 0)
+    {
+        printf("FAIL: nothing was delivered\n");
+        return 1;
+    }
+
+    printf("speedup:        %12.2fx\n", ring_rr.rate / legacy_rr.rate);
+
+    if(ring_rr.rate < legacy_rr.rate)
+    {
+        printf("FAIL: ring delivers less than the locked mailbox\n");
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}